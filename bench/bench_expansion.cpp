@@ -0,0 +1,66 @@
+// Macro expansion throughput on macro-sparse and macro-dense inputs, for a
+// one-shot preprocess() and for instantiating a precompiled ShaderTemplate.
+// Build with -DPRE_WGSL_NO_SIMD to compare against the scalar scanner.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "pre_wgsl.hpp"
+
+// Long identifiers, almost none of which are macros
+static std::string make_sparse(size_t target_bytes) {
+    std::string src = "#define SCALE 2.0\n";
+    size_t i = 0;
+    while (src.size() < target_bytes) {
+        std::string n = std::to_string(i++);
+        src += "    let accumulated_value_" + n + " = input_buffer_data[global_invocation_index] * "
+               "weight_matrix_element + bias_vector_component;\n";
+        if (i % 64 == 0)
+            src += "    output_buffer_data[global_invocation_index] = accumulated_value_" + n +
+                   " * SCALE;\n";
+    }
+    return src;
+}
+
+// Short lines where most identifiers are macros
+static std::string make_dense(size_t target_bytes) {
+    std::string src =
+        "#define T f32\n#define WG 64\n#define A (WG * 2)\n#define B (A + WG)\n#define ZERO T(0)\n";
+    while (src.size() < target_bytes)
+        src += "var<workgroup> t : array<T, B>; let z : T = ZERO + T(A);\n";
+    return src;
+}
+
+template <typename F>
+static double mb_per_s(size_t bytes, int reps, F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++)
+        f();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)bytes * reps / (1024.0 * 1024.0) / secs;
+}
+
+static void run(const char *name, const std::string &src, int reps) {
+    pre_wgsl::Preprocessor pp;
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+    size_t sink = 0;
+    double one_shot = mb_per_s(src.size(), reps, [&] { sink += pp.preprocess(src).size(); });
+    double inst = mb_per_s(src.size(), reps, [&] { sink += tpl.instantiate().size(); });
+    std::cout << name << " (" << src.size() << " bytes): preprocess " << one_shot
+              << " MB/s, instantiate " << inst << " MB/s\n";
+    if (sink == 0)
+        std::cout << "(empty output)\n";
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    int reps = argc > 2 ? std::atoi(argv[2]) : 5;
+#ifdef PRE_WGSL_SIMD_WIDTH
+    std::cout << "simd width: " << PRE_WGSL_SIMD_WIDTH << " bytes\n";
+#endif
+    run("macro-sparse", make_sparse(mb * 1024 * 1024), reps);
+    run("macro-dense ", make_dense(mb * 1024 * 1024), reps);
+    return 0;
+}
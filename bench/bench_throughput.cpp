@@ -0,0 +1,52 @@
+// Measures single-call preprocess() throughput in MB/s on a large generated
+// shader: mostly plain code lines, with a sprinkling of directives and macros.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "pre_wgsl.hpp"
+
+static std::string make_shader(size_t target_bytes) {
+    std::string src = "#define WG_SIZE 256\n#define FLOAT f32\n";
+    size_t i = 0;
+    while (src.size() < target_bytes) {
+        std::string n = std::to_string(i++);
+        src += "// kernel " + n + ": accumulate a row of the output tile\n";
+        src += "fn kernel_" + n + "(idx : u32, src : ptr<storage, array<f32>, read>) -> f32 {\n";
+        src += "    var acc : f32 = 0.0;\n";
+        src += "    for (var k : u32 = 0u; k < 64u; k = k + 1u) {\n";
+        src += "        acc = acc + (*src)[idx * 64u + k] * 0.5;\n";
+        src += "    }\n";
+        if (i % 8 == 0) {
+            src += "#if WG_SIZE > 128\n";
+            src += "    acc = acc * FLOAT(WG_SIZE);\n";
+            src += "#endif\n";
+        }
+        src += "    return acc;\n}\n\n";
+    }
+    return src;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 8;
+    int reps = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    const std::string src = make_shader(mb * 1024 * 1024);
+    pre_wgsl::Preprocessor pp;
+
+    size_t out_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++)
+        out_bytes += pp.preprocess(src).size();
+    auto end = std::chrono::steady_clock::now();
+
+    double secs = std::chrono::duration<double>(end - start).count();
+    double mbps = (double)src.size() * reps / (1024.0 * 1024.0) / secs;
+    std::cout << "source: " << src.size() << " bytes, output: " << out_bytes / reps
+              << " bytes\n";
+    std::cout << "preprocess(): " << mbps << " MB/s (" << 1000.0 * secs / reps
+              << " ms/call)\n";
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Compares the per-variant cost of preprocess_variants() and
+// preprocess_parallel() against calling preprocess() once per macro set on a
+// synthetic matmul-style shader.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pre_wgsl.hpp"
+
+static std::string make_shader(int blocks) {
+    std::ostringstream ss;
+    ss << "#define WG_SIZE 64\n"
+       << "#ifdef USE_F16\nenable f16;\n#define FLOAT f16\n#else\n#define FLOAT f32\n#endif\n";
+    for (int i = 0; i < blocks; i++) {
+        ss << "#if TILE_M == 4 && defined(VEC4)\n"
+           << "fn block_" << i << "(a : vec4<FLOAT>, b : vec4<FLOAT>) -> vec4<FLOAT> {\n"
+           << "    var acc : vec4<FLOAT> = vec4<FLOAT>(0.0);\n"
+           << "    for (var k = 0u; k < WG_SIZE; k++) { acc += a * b; }\n"
+           << "    return acc;\n}\n"
+           << "#elif TILE_M == 8\n"
+           << "fn block_" << i << "(a : FLOAT, b : FLOAT) -> FLOAT {\n"
+           << "    var acc : FLOAT = 0.0;\n"
+           << "    for (var k = 0u; k < WG_SIZE * TILE_M; k++) { acc += a * b; }\n"
+           << "    return acc;\n}\n"
+           << "#else\n"
+           << "fn block_" << i << "() {}\n"
+           << "#endif\n";
+    }
+    return ss.str();
+}
+
+static std::vector<std::vector<std::string>> make_macro_sets(int count) {
+    std::vector<std::vector<std::string>> sets;
+    for (int i = 0; i < count; i++) {
+        std::vector<std::string> set = {"TILE_M=" + std::to_string(4 << (i % 3))};
+        if (i % 2)
+            set.push_back("USE_F16");
+        if (i % 4 < 2)
+            set.push_back("VEC4");
+        sets.push_back(set);
+    }
+    return sets;
+}
+
+template <typename F>
+static double time_ms(F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+    int blocks = argc > 1 ? std::atoi(argv[1]) : 200;
+    int variants = argc > 2 ? std::atoi(argv[2]) : 300;
+
+    const std::string src = make_shader(blocks);
+    const auto sets = make_macro_sets(variants);
+    pre_wgsl::Preprocessor pp;
+
+    size_t bytes_loop = 0;
+    double loop_ms = time_ms([&] {
+        for (const auto &set : sets)
+            bytes_loop += pp.preprocess(src, set).size();
+    });
+
+    size_t bytes_batch = 0;
+    double batch_ms = time_ms([&] {
+        for (const auto &out : pp.preprocess_variants(src, sets))
+            bytes_batch += out.size();
+    });
+
+    std::vector<pre_wgsl::VariantJob> jobs;
+    for (const auto &set : sets)
+        jobs.push_back({src, "", set});
+    size_t bytes_parallel = 0;
+    double parallel_ms = time_ms([&] {
+        for (const auto &out : pp.preprocess_parallel(jobs))
+            bytes_parallel += out.size();
+    });
+
+    if (bytes_loop != bytes_batch || bytes_loop != bytes_parallel) {
+        std::cerr << "output mismatch between preprocess, preprocess_variants and preprocess_parallel\n";
+        return 1;
+    }
+
+    std::cout << "source: " << src.size() << " bytes, " << variants << " variants\n";
+    std::cout << "preprocess() loop:     " << loop_ms << " ms total, "
+              << 1000.0 * loop_ms / variants << " us/variant\n";
+    std::cout << "preprocess_variants(): " << batch_ms << " ms total, "
+              << 1000.0 * batch_ms / variants << " us/variant\n";
+    std::cout << "preprocess_parallel(): " << parallel_ms << " ms total, "
+              << 1000.0 * parallel_ms / variants << " us/variant ("
+              << std::thread::hardware_concurrency() << " threads)\n";
+    return 0;
+}
@@ -0,0 +1,469 @@
+// End-to-end benchmark over a synthetic corpus shaped like real workloads:
+//
+//   matmul  llama.cpp-style quantized matmul shader with deep #if nesting and
+//           shared includes, swept over its type/vector/workgroup variants
+//   dense   macro-dense code (most identifiers are macros), 1 KB - 10 MB
+//   sparse  mostly plain code with few directives, 1 KB - 10 MB
+//
+// Every case is run through preprocess(), preprocess_file() and
+// preprocess_includes(), reporting throughput, per-call latency percentiles
+// and heap allocations per call.
+//
+// Usage: pre_wgsl_bench [max_mb] [min_seconds]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "pre_wgsl.hpp"
+
+namespace fs = std::filesystem;
+
+//==============================================================
+// Allocation counting
+//==============================================================
+static std::atomic<size_t> g_allocations{0};
+
+// Every replaceable operator new/delete goes through these two, so each
+// pointer is released the way it was allocated. Over-aligned blocks keep
+// the malloc() result in the slot just below the aligned address.
+static void *counted_alloc(std::size_t size, std::size_t align) noexcept {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0)
+        size = 1;
+    if (align <= alignof(std::max_align_t))
+        return std::malloc(size);
+    void *raw = std::malloc(size + align + sizeof(void *));
+    if (!raw)
+        return nullptr;
+    std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void *);
+    addr = (addr + align - 1) & ~(std::uintptr_t(align) - 1);
+    reinterpret_cast<void **>(addr)[-1] = raw;
+    return reinterpret_cast<void *>(addr);
+}
+
+static void counted_free(void *p, std::size_t align) noexcept {
+    if (p && align > alignof(std::max_align_t))
+        p = static_cast<void **>(p)[-1];
+    std::free(p);
+}
+
+static void *counted_new(std::size_t size, std::size_t align) {
+    if (void *p = counted_alloc(size, align))
+        return p;
+    throw std::bad_alloc();
+}
+
+static constexpr std::size_t kDefaultAlign = alignof(std::max_align_t);
+
+void *operator new(std::size_t size) { return counted_new(size, kDefaultAlign); }
+void *operator new[](std::size_t size) { return counted_new(size, kDefaultAlign); }
+void *operator new(std::size_t size, std::align_val_t al) {
+    return counted_new(size, static_cast<std::size_t>(al));
+}
+void *operator new[](std::size_t size, std::align_val_t al) {
+    return counted_new(size, static_cast<std::size_t>(al));
+}
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, kDefaultAlign);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, kDefaultAlign);
+}
+void *operator new(std::size_t size, std::align_val_t al, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, static_cast<std::size_t>(al));
+}
+void *operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, static_cast<std::size_t>(al));
+}
+
+void operator delete(void *p) noexcept { counted_free(p, kDefaultAlign); }
+void operator delete[](void *p) noexcept { counted_free(p, kDefaultAlign); }
+void operator delete(void *p, std::size_t) noexcept { counted_free(p, kDefaultAlign); }
+void operator delete[](void *p, std::size_t) noexcept { counted_free(p, kDefaultAlign); }
+void operator delete(void *p, std::align_val_t al) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+void operator delete[](void *p, std::align_val_t al) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+void operator delete(void *p, std::size_t, std::align_val_t al) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+void operator delete[](void *p, std::size_t, std::align_val_t al) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    counted_free(p, kDefaultAlign);
+}
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    counted_free(p, kDefaultAlign);
+}
+void operator delete(void *p, std::align_val_t al, const std::nothrow_t &) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+void operator delete[](void *p, std::align_val_t al, const std::nothrow_t &) noexcept {
+    counted_free(p, static_cast<std::size_t>(al));
+}
+
+//==============================================================
+// Corpus
+//==============================================================
+struct Variant {
+    std::string name;
+    std::vector<std::string> macros;
+};
+
+struct Case {
+    std::string name;
+    std::string source;
+    std::string file; // `source` written to disk, for preprocess_file()
+    std::vector<Variant> variants;
+};
+
+static void write_file(const fs::path &path, const std::string &text) {
+    std::ofstream f(path, std::ios::binary);
+    f << text;
+}
+
+static std::string make_quant_types() {
+    std::string s;
+    s += "#ifndef QUANT_TYPES\n#define QUANT_TYPES\n";
+    s += "#if defined(TYPE_Q4_0) || defined(TYPE_Q4_1)\n";
+    s += "#define BLOCK_SIZE 32\n#define QK 32\n";
+    s += "struct block_q4 {\n    d : f16,\n#ifdef TYPE_Q4_1\n    m : f16,\n"
+         "#endif\n    qs : array<u32, 4>,\n};\n";
+    s += "#define SRC0_TYPE block_q4\n";
+    s += "#elif defined(TYPE_Q8_0)\n";
+    s += "#define BLOCK_SIZE 32\n#define QK 32\n";
+    s += "struct block_q8_0 {\n    d : f16,\n    qs : array<u32, 8>,\n};\n";
+    s += "#define SRC0_TYPE block_q8_0\n";
+    s += "#elif defined(TYPE_F16)\n";
+    s += "#define BLOCK_SIZE 1\n#define QK 1\n#define SRC0_TYPE f16\n";
+    s += "#else\n";
+    s += "#define BLOCK_SIZE 1\n#define QK 1\n#define SRC0_TYPE f32\n";
+    s += "#endif\n";
+    s += "#endif\n";
+    return s;
+}
+
+static std::string make_common() {
+    std::string s;
+    s += "#ifndef COMMON_DECLS\n#define COMMON_DECLS\n";
+    s += "struct MulMatParams {\n    m : u32,\n    n : u32,\n    k : u32,\n"
+         "    stride_01 : u32,\n    stride_11 : u32,\n    stride_02 : u32,\n"
+         "    stride_12 : u32,\n};\n";
+    s += "@group(0) @binding(3) var<uniform> params : MulMatParams;\n";
+    for (int i = 0; i < 24; i++) {
+        std::string n = std::to_string(i);
+        s += "fn helper_" + n + "(x : f32) -> f32 {\n";
+        s += "#if defined(USE_FMA) && QK > 1\n";
+        s += "    return fma(x, " + n + ".0, 1.0);\n";
+        s += "#else\n";
+        s += "    return x * " + n + ".0 + 1.0;\n";
+        s += "#endif\n}\n";
+    }
+    s += "#endif\n";
+    return s;
+}
+
+static std::string make_matmul() {
+    std::string s;
+    s += "#include \"common_decls.wgsl\"\n";
+    s += "#include \"quant_types.wgsl\"\n";
+    s += "#define TILE_M (WG_SIZE / 8)\n";
+    s += "#define TILE_N 8\n";
+    s += "#if VEC4\n#define VEC_TYPE vec4<f32>\n#define VEC_SIZE 4\n"
+         "#else\n#define VEC_TYPE f32\n#define VEC_SIZE 1\n#endif\n";
+    s += "@group(0) @binding(0) var<storage, read_write> src0 : "
+         "array<SRC0_TYPE>;\n";
+    s += "@group(0) @binding(1) var<storage, read_write> src1 : "
+         "array<VEC_TYPE>;\n";
+    s += "@group(0) @binding(2) var<storage, read_write> dst : "
+         "array<f32>;\n";
+    s += "var<workgroup> tile : array<VEC_TYPE, TILE_M * TILE_N>;\n";
+
+    for (int k = 0; k < 12; k++) {
+        std::string n = std::to_string(k);
+        s += "fn dequant_" + n + "(idx : u32) -> VEC_TYPE {\n";
+        s += "#if defined(TYPE_Q4_0) || defined(TYPE_Q4_1)\n";
+        s += "    let block = src0[idx / QK];\n";
+        s += "    let d = f32(block.d);\n";
+        s += "#if VEC_SIZE == 4\n";
+        s += "#if defined(USE_SUBGROUPS) && WG_SIZE >= 64\n";
+        s += "#ifdef TYPE_Q4_1\n";
+        s += "    let m = f32(block.m);\n";
+        s += "    return VEC_TYPE(d) * unpack_q4(block.qs[" + n +
+             " % 4u]) + VEC_TYPE(m);\n";
+        s += "#else\n";
+        s += "    return VEC_TYPE(d) * (unpack_q4(block.qs[" + n +
+             " % 4u]) - VEC_TYPE(8.0));\n";
+        s += "#endif\n";
+        s += "#else\n";
+        s += "    return VEC_TYPE(d * f32(block.qs[" + n + " % 4u] & 0xfu));\n";
+        s += "#endif\n";
+        s += "#else\n";
+        s += "    return d * f32((block.qs[idx % 4u] >> (4u * " + n +
+             "u)) & 0xfu);\n";
+        s += "#endif\n";
+        s += "#elif defined(TYPE_Q8_0)\n";
+        s += "    let block = src0[idx / QK];\n";
+        s += "#if VEC_SIZE == 4 && WG_SIZE > 32\n";
+        s += "    return VEC_TYPE(f32(block.d)) * unpack_q8(block.qs[" + n +
+             " % 8u]);\n";
+        s += "#else\n";
+        s += "    return VEC_TYPE(f32(block.d) * f32(block.qs[" + n +
+             " % 8u] & 0xffu));\n";
+        s += "#endif\n";
+        s += "#else\n";
+        s += "    return VEC_TYPE(src0[idx]);\n";
+        s += "#endif\n";
+        s += "}\n\n";
+    }
+
+    s += "@compute @workgroup_size(WG_SIZE)\n";
+    s += "fn main(@builtin(global_invocation_id) gid : vec3<u32>,\n"
+         "        @builtin(local_invocation_id) lid : vec3<u32>) {\n";
+    s += "    var acc : VEC_TYPE = VEC_TYPE(0.0);\n";
+    s += "    for (var k : u32 = 0u; k < params.k; k = k + TILE_N) {\n";
+    s += "        tile[lid.x] = dequant_0(gid.x * params.stride_01 + k);\n";
+    s += "        workgroupBarrier();\n";
+    s += "        for (var t : u32 = 0u; t < TILE_N; t = t + 1u) {\n";
+    s += "            acc = acc + tile[t] * src1[k + t];\n";
+    s += "        }\n";
+    s += "        workgroupBarrier();\n";
+    s += "    }\n";
+    s += "#if VEC_SIZE == 4\n";
+    s += "    dst[gid.x] = helper_0(acc.x + acc.y + acc.z + acc.w);\n";
+    s += "#else\n";
+    s += "    dst[gid.x] = helper_0(acc);\n";
+    s += "#endif\n";
+    s += "}\n";
+    return s;
+}
+
+static std::vector<Variant> make_matmul_variants() {
+    std::vector<Variant> out;
+    const char *types[] = {"TYPE_Q4_0", "TYPE_Q4_1", "TYPE_Q8_0", "TYPE_F16",
+                           "TYPE_F32"};
+    for (const char *type : types) {
+        for (int vec4 = 0; vec4 < 2; vec4++) {
+            for (int wg : {32, 64, 128, 256}) {
+                for (int sg = 0; sg < 2; sg++) {
+                    Variant v;
+                    v.name = std::string(type) + (vec4 ? "_vec4" : "") +
+                             "_wg" + std::to_string(wg) + (sg ? "_sg" : "");
+                    v.macros = {type, "VEC4=" + std::to_string(vec4),
+                                "WG_SIZE=" + std::to_string(wg), "USE_FMA"};
+                    if (sg)
+                        v.macros.push_back("USE_SUBGROUPS");
+                    out.push_back(std::move(v));
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Nearly every identifier is a macro; many are expression-valued
+static std::string make_dense(size_t target_bytes) {
+    std::string s;
+    for (int i = 0; i < 8; i++) {
+        std::string n = std::to_string(i);
+        s += "#define M" + n + " (A" + n + " + B" + n + ")\n";
+        s += "#define A" + n + " " + n + "\n";
+        s += "#define B" + n + " u" + n + "\n";
+    }
+    size_t i = 0;
+    while (s.size() < target_bytes) {
+        std::string a = std::to_string(i % 8);
+        std::string b = std::to_string((i * 3) % 8);
+        s += "let v" + std::to_string(i) + " = M" + a + " * M" + b + " + A" +
+             b + " - B" + a + ";\n";
+        if (i % 16 == 0)
+            s += "#if A" + a + " > 4 && defined(M" + b + ")\nlet w = M" + a +
+                 ";\n#endif\n";
+        i++;
+    }
+    return s;
+}
+
+// Mostly plain code; macros are rare
+static std::string make_sparse(size_t target_bytes) {
+    std::string s = "#define WG_SIZE 256\n#define FLOAT f32\n";
+    size_t i = 0;
+    while (s.size() < target_bytes) {
+        std::string n = std::to_string(i++);
+        s += "// kernel " + n + ": accumulate a row of the output tile\n";
+        s += "fn kernel_" + n + "(idx : u32) -> f32 {\n";
+        s += "    var acc : f32 = 0.0;\n";
+        s += "    for (var k : u32 = 0u; k < 64u; k = k + 1u) {\n";
+        s += "        acc = acc + data[idx * 64u + k] * 0.5;\n";
+        s += "    }\n";
+        if (i % 8 == 0)
+            s += "#if WG_SIZE > 128\n    acc = acc * FLOAT(WG_SIZE);\n"
+                 "#endif\n";
+        s += "    return acc;\n}\n\n";
+    }
+    return s;
+}
+
+static std::string size_label(size_t bytes) {
+    if (bytes >= 1024 * 1024)
+        return std::to_string(bytes / (1024 * 1024)) + "MB";
+    return std::to_string(bytes / 1024) + "KB";
+}
+
+static std::vector<Case> make_corpus(const fs::path &dir, size_t max_bytes) {
+    write_file(dir / "common_decls.wgsl", make_common());
+    write_file(dir / "quant_types.wgsl", make_quant_types());
+
+    std::vector<Case> corpus;
+    Case matmul;
+    matmul.name = "matmul";
+    matmul.source = make_matmul();
+    matmul.variants = make_matmul_variants();
+    corpus.push_back(std::move(matmul));
+
+    for (size_t bytes : {size_t(1) << 10, size_t(64) << 10, size_t(1) << 20,
+                         size_t(10) << 20}) {
+        if (bytes > max_bytes)
+            break;
+        corpus.push_back({"dense_" + size_label(bytes), make_dense(bytes), "",
+                          {{"default", {}}}});
+        corpus.push_back({"sparse_" + size_label(bytes), make_sparse(bytes),
+                          "", {{"default", {}}}});
+    }
+
+    for (Case &c : corpus) {
+        c.file = (dir / (c.name + ".wgsl")).string();
+        write_file(c.file, c.source);
+    }
+    return corpus;
+}
+
+//==============================================================
+// Measurement
+//==============================================================
+struct Result {
+    size_t calls = 0;
+    double seconds = 0;
+    size_t allocations = 0;
+    std::vector<double> latencies_us;
+};
+
+// Run `call` for every variant, repeating the sweep until `min_seconds`
+// have passed (at least twice, so caches are warm for all but the first)
+static Result measure(const Case &c, double min_seconds,
+                      const std::function<size_t(const Variant &)> &call) {
+    Result r;
+    size_t sink = 0;
+    for (const Variant &v : c.variants) // warm-up
+        sink += call(v);
+
+    auto begin = std::chrono::steady_clock::now();
+    size_t allocs_before = g_allocations.load(std::memory_order_relaxed);
+    for (int sweep = 0;; sweep++) {
+        for (const Variant &v : c.variants) {
+            auto t0 = std::chrono::steady_clock::now();
+            sink += call(v);
+            auto t1 = std::chrono::steady_clock::now();
+            r.latencies_us.push_back(
+                std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+        r.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - begin)
+                        .count();
+        if (sweep >= 1 && r.seconds >= min_seconds)
+            break;
+    }
+    r.allocations = g_allocations.load(std::memory_order_relaxed) -
+                    allocs_before;
+    r.calls = r.latencies_us.size();
+    if (sink == 0)
+        std::cerr << "warning: empty output for " << c.name << "\n";
+    return r;
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void report(const Case &c, const char *api, const Result &r) {
+    double mbps = (double)c.source.size() * r.calls / (1024.0 * 1024.0) /
+                  r.seconds;
+    std::printf("%-12s %-20s %8zu %7zu %10.1f %10.1f %10.1f %10.1f %9.1f\n",
+                c.name.c_str(), api, c.source.size(), r.calls, mbps,
+                percentile(r.latencies_us, 0.50),
+                percentile(r.latencies_us, 0.90),
+                percentile(r.latencies_us, 0.99),
+                (double)r.allocations / r.calls);
+}
+
+int main(int argc, char **argv) {
+    size_t max_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10;
+    double min_seconds = argc > 2 ? std::atof(argv[2]) : 0.5;
+
+    fs::path dir = fs::temp_directory_path() / "pre_wgsl_bench";
+    fs::create_directories(dir);
+    std::vector<Case> corpus = make_corpus(dir, max_mb << 20);
+
+    pre_wgsl::Options opts;
+    opts.include_path = dir.string();
+    pre_wgsl::Preprocessor pp(opts);
+    opts.minify = true;
+    pre_wgsl::Preprocessor minifier(opts);
+
+    std::printf("%-12s %-20s %8s %7s %10s %10s %10s %10s %9s\n", "case", "api",
+                "bytes", "calls", "MB/s", "p50 us", "p90 us", "p99 us",
+                "allocs");
+    for (const Case &c : corpus) {
+        report(c, "preprocess",
+               measure(c, min_seconds, [&](const Variant &v) {
+                   return pp.preprocess(c.source, v.macros).size();
+               }));
+        report(c, "preprocess_file",
+               measure(c, min_seconds, [&](const Variant &v) {
+                   return pp.preprocess_file(c.file, v.macros).size();
+               }));
+        report(c, "preprocess_includes",
+               measure(c, min_seconds, [&](const Variant &) {
+                   return pp.preprocess_includes(c.source).size();
+               }));
+        report(c, "preprocess (minify)",
+               measure(c, min_seconds, [&](const Variant &v) {
+                   return minifier.preprocess(c.source, v.macros).size();
+               }));
+    }
+
+    // Output size with and without minification, summed over the variants
+    std::printf("\n%-12s %12s %12s %9s\n", "case", "output", "minified",
+                "saved");
+    for (const Case &c : corpus) {
+        size_t plain = 0, minified = 0;
+        for (const Variant &v : c.variants) {
+            plain += pp.preprocess(c.source, v.macros).size();
+            minified += minifier.preprocess(c.source, v.macros).size();
+        }
+        std::printf("%-12s %12zu %12zu %8.1f%%\n", c.name.c_str(), plain,
+                    minified, plain ? 100.0 * (plain - minified) / plain : 0.0);
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
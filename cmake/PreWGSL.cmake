@@ -0,0 +1,85 @@
+# ============================================================================
+# pre_wgsl_add_shaders(<target>
+#     SHADERS <file>...
+#     [VARIANTS <name:MACRO,MACRO=value>...]
+#     [MACROS <MACRO[=value]>...]
+#     [INCLUDE_DIR <dir>...]
+#     [HEADER <name.hpp>]
+#     [NAMESPACE <ns>])
+#
+# Preprocesses every shader once per variant at build time and generates
+# HEADER (default <target>_shaders.hpp) for <target> to include. For each
+# shader and variant the header holds a `constexpr std::string_view` named
+# shader_<stem>_<variant>, keyed "<shader stem>/<variant name>" (just
+# "<shader stem>" without VARIANTS), and `find_variant(key)` looks one up
+# in a sorted table. MACROS apply to every variant. Includes are searched
+# next to the including file, then in each INCLUDE_DIR in order.
+#
+# The generator is built for the host from tools/. When cross-compiling, set
+# PRE_WGSL_EMBED_EXECUTABLE to a host build of pre-wgsl-embed.
+# ============================================================================
+function(pre_wgsl_add_shaders TARGET)
+    cmake_parse_arguments(ARG "" "HEADER;NAMESPACE" "SHADERS;VARIANTS;MACROS;INCLUDE_DIR" ${ARGN})
+    if (NOT ARG_SHADERS)
+        message(FATAL_ERROR "pre_wgsl_add_shaders(${TARGET}): no SHADERS given")
+    endif()
+    if (NOT ARG_HEADER)
+        set(ARG_HEADER "${TARGET}_shaders.hpp")
+    endif()
+    if (NOT ARG_NAMESPACE)
+        string(MAKE_C_IDENTIFIER "${TARGET}_shaders" ARG_NAMESPACE)
+    endif()
+
+    if (PRE_WGSL_EMBED_EXECUTABLE)
+        set(embed "${PRE_WGSL_EMBED_EXECUTABLE}")
+    else()
+        set(embed $<TARGET_FILE:pre-wgsl-embed>)
+        set(embed_target pre-wgsl-embed)
+    endif()
+
+    set(out_dir "${CMAKE_CURRENT_BINARY_DIR}/pre_wgsl/${TARGET}")
+    set(header "${out_dir}/${ARG_HEADER}")
+
+    set(args -o "${header}" --namespace "${ARG_NAMESPACE}")
+    foreach(include_dir IN LISTS ARG_INCLUDE_DIR)
+        get_filename_component(include_dir "${include_dir}" ABSOLUTE)
+        list(APPEND args -I "${include_dir}")
+    endforeach()
+    foreach(macro IN LISTS ARG_MACROS)
+        list(APPEND args -D "${macro}")
+    endforeach()
+    foreach(variant IN LISTS ARG_VARIANTS)
+        list(APPEND args --variant "${variant}")
+    endforeach()
+    set(shaders "")
+    foreach(shader IN LISTS ARG_SHADERS)
+        get_filename_component(shader "${shader}" ABSOLUTE)
+        list(APPEND shaders "${shader}")
+        list(APPEND args --shader "${shader}")
+    endforeach()
+
+    # Includes are only known once the shaders are preprocessed, so the tool
+    # reports them in a depfile where the generator supports one: Ninja
+    # always, Makefiles from CMake 3.20, every generator from 3.21
+    set(depfile_args "")
+    if (CMAKE_GENERATOR MATCHES "Ninja"
+        OR (CMAKE_GENERATOR MATCHES "Makefiles" AND CMAKE_VERSION VERSION_GREATER_EQUAL 3.20)
+        OR CMAKE_VERSION VERSION_GREATER_EQUAL 3.21)
+        list(APPEND args --depfile "${header}.d")
+        set(depfile_args DEPFILE "${header}.d")
+    endif()
+
+    add_custom_command(
+        OUTPUT "${header}"
+        COMMAND ${CMAKE_COMMAND} -E make_directory "${out_dir}"
+        COMMAND ${embed} ${args}
+        DEPENDS ${shaders} ${embed_target}
+        ${depfile_args}
+        COMMENT "Preprocessing shaders into ${ARG_HEADER}"
+        VERBATIM
+    )
+
+    target_sources(${TARGET} PRIVATE "${header}")
+    target_include_directories(${TARGET} PRIVATE "${out_dir}")
+    target_compile_features(${TARGET} PRIVATE cxx_std_17)
+endfunction()
@@ -1,15 +1,193 @@
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
 #include <string>
 #include <vector>
 #include "pre_wgsl.hpp"
 
+namespace fs = std::filesystem;
+
 void print_usage() {
-    std::cout << "Usage: pre-wgsl-cli <input.wgsl> [-I include_path] [-D MACRO[=value]] [-o output.wgsl]\n";
+    std::cout << "Usage: pre-wgsl-cli <input.wgsl> [-I include_path] [-D MACRO[=value]] [-o output.wgsl] [--trace trace.json] [-MD] [-MF deps.d] [--cache-dir dir]\n";
     std::cout << "Options:\n";
-    std::cout << "  -I <path>      Set include path for #include directives\n";
+    std::cout << "  -I <path>      Add an include search path (repeatable, searched in order)\n";
     std::cout << "  -D <macro>     Define a macro (e.g., -D FOO or -D BAR=1)\n";
     std::cout << "  -o <output>    Write output to file instead of stdout\n";
+    std::cout << "  --trace <file> Write a Chrome trace (open in Perfetto)\n";
+    std::cout << "  -MD            Write a Make/Ninja dependency file next to the output\n";
+    std::cout << "  -MF <file>     Write the dependency file to <file> (implies -MD)\n";
+    std::cout << "  --cache-dir <dir>  Reuse results stored in <dir> by earlier runs\n";
+}
+
+// Escape a path for the rule syntax shared by Make and Ninja depfiles
+static std::string escape_dep(const std::string& path) {
+    std::string out;
+    for (char c : path) {
+        if (c == ' ' || c == '#')
+            out += '\\';
+        else if (c == '$')
+            out += '$';
+        out += c;
+    }
+    return out;
+}
+
+// ----------------------------------------------------------------------------
+// Output cache
+//
+// A result is stored under a key covering the input bytes, the -I path, the
+// sorted -D macros and the contents of every file the input included. Which
+// files those are is only known after preprocessing, so a manifest keyed by
+// everything but the includes lists the files the last run used; a lookup
+// hashes their current contents to find the stored result. The manifest
+// also lists the paths searched ahead of each include that did not exist,
+// as a file created at one of them would be read instead.
+// ----------------------------------------------------------------------------
+// Length-prefixed, so that field boundaries are part of the key
+static uint64_t mix(uint64_t h, const std::string& field) {
+    return pre_wgsl::hash64(field, pre_wgsl::hash64(std::to_string(field.size()) + ":", h));
+}
+
+static std::string hex(uint64_t h) {
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    return buf;
+}
+
+static bool read_file(const std::string& path, std::string& out) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+        return false;
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+// Write to a unique temporary file and rename it into place, so concurrent
+// jobs sharing the cache never see a partial entry
+static void write_atomic(const fs::path& path, const std::string& data) {
+    static std::mt19937_64 rng{std::random_device{}()};
+    fs::path tmp = path;
+    tmp += ".tmp." + hex(rng());
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f << data;
+        if (!f.flush()) {
+            fs::remove(tmp);
+            throw std::runtime_error("Could not write file: " + tmp.string());
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp);
+        throw std::runtime_error("Could not write file: " + path.string());
+    }
+}
+
+static std::string manifest_key(const std::string& input, const std::string& source,
+                                const pre_wgsl::Options& opts) {
+    // Split and trimmed as the preprocessor does, where the last definition
+    // of a name wins
+    std::map<std::string, std::string> macros;
+    for (const auto& def : opts.macros) {
+        auto [name, value] = pre_wgsl::parseMacroDefinition(def);
+        macros[name] = value;
+    }
+
+    uint64_t h = mix(0, "pre-wgsl-cache-v6");
+    h = mix(h, source);
+    // Includes are looked up next to the input first
+    h = mix(h, fs::path(input).parent_path().string());
+    h = mix(h, opts.include_path);
+    h = mix(h, std::to_string(opts.include_paths.size()));
+    for (const auto& path : opts.include_paths)
+        h = mix(h, path);
+    h = mix(h, std::to_string(macros.size()));
+    for (const auto& [name, value] : macros)
+        h = mix(mix(h, name), value);
+    return hex(h);
+}
+
+// False if one of the includes can no longer be read, or one of the missing
+// paths now exists
+static bool result_key(const std::string& manifest, const pre_wgsl::Stats& deps,
+                       std::string& key) {
+    uint64_t h = mix(0, manifest);
+    for (const auto& inc : deps.includes) {
+        std::string contents;
+        if (!read_file(inc, contents))
+            return false;
+        h = mix(mix(h, inc), contents);
+    }
+    h = mix(h, std::to_string(deps.missing_includes.size()));
+    for (const auto& path : deps.missing_includes) {
+        std::error_code ec;
+        if (fs::is_regular_file(path, ec))
+            return false;
+        h = mix(h, path);
+    }
+    key = hex(h);
+    return true;
+}
+
+static bool cache_lookup(const fs::path& dir, const std::string& manifest,
+                         std::string& result, pre_wgsl::Stats& deps) {
+    std::string listing;
+    if (!read_file((dir / (manifest + ".deps")).string(), listing))
+        return false;
+    deps.includes.clear();
+    deps.missing_includes.clear();
+    // "+ path" for an include, "- path" for a path that did not exist
+    std::istringstream lines(listing);
+    for (std::string line; std::getline(lines, line);) {
+        if (line.rfind("+ ", 0) == 0)
+            deps.includes.push_back(line.substr(2));
+        else if (line.rfind("- ", 0) == 0)
+            deps.missing_includes.push_back(line.substr(2));
+        else
+            return false;
+    }
+
+    std::string key;
+    return result_key(manifest, deps, key) &&
+           read_file((dir / (key + ".wgsl")).string(), result);
+}
+
+static void cache_store(const fs::path& dir, const std::string& manifest,
+                        const std::string& result, const pre_wgsl::Stats& deps) {
+    std::string key;
+    if (!result_key(manifest, deps, key))
+        return;
+    std::string listing;
+    for (const auto& inc : deps.includes)
+        listing += "+ " + inc + "\n";
+    for (const auto& path : deps.missing_includes)
+        listing += "- " + path + "\n";
+    fs::create_directories(dir);
+    // The result goes first: a manifest must never point at a missing result
+    write_atomic(dir / (key + ".wgsl"), result);
+    write_atomic(dir / (manifest + ".deps"), listing);
+}
+
+static void write_depfile(const std::string& depfile, const std::string& target,
+                          const std::string& input,
+                          const std::vector<std::string>& includes) {
+    std::ofstream f(depfile);
+    if (!f.is_open())
+        throw std::runtime_error("Could not open file: " + depfile);
+    f << escape_dep(target) << ":";
+    f << " \\\n  " << escape_dep(input);
+    for (const auto& inc : includes)
+        f << " \\\n  " << escape_dep(inc);
+    f << "\n";
 }
 
 int main(int argc, char** argv) {
@@ -20,9 +198,14 @@ int main(int argc, char** argv) {
 
     std::string input = argv[1];
     std::string output;
+    std::string trace;
+    bool write_deps = false;
+    std::string depfile;
+    std::string cache_dir;
 
     pre_wgsl::Options opts;
     opts.include_path = ".";
+    bool include_set = false;
 
     for (int i = 2; i < argc; i++) {
         std::string arg = argv[i];
@@ -30,29 +213,100 @@ int main(int argc, char** argv) {
         if (arg == "-o" && i + 1 < argc) {
             output = argv[++i];
         } else if (arg == "-I" && i + 1 < argc) {
-            opts.include_path = argv[++i];
+            // Searched in the order given
+            if (include_set)
+                opts.include_paths.push_back(argv[++i]);
+            else
+                opts.include_path = argv[++i];
+            include_set = true;
         } else if (arg == "-D" && i + 1 < argc) {
             opts.macros.push_back(argv[++i]);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (arg == "-MD") {
+            write_deps = true;
+        } else if (arg == "-MF" && i + 1 < argc) {
+            write_deps = true;
+            depfile = argv[++i];
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            cache_dir = argv[++i];
         } else if (arg == "-h") {
             print_usage();
             return 0;
         }
     }
 
+    if (write_deps && output.empty()) {
+        std::cerr << "pre-wgsl error: -MD/-MF need an output file (-o)\n";
+        return 1;
+    }
+
+    if (!trace.empty())
+        opts.tracer = std::make_shared<pre_wgsl::Tracer>();
+
+    int status = 0;
     try {
         pre_wgsl::Preprocessor pp(opts);
-        std::string result = pp.preprocess_file(input);
+        pre_wgsl::Stats stats;
+        pre_wgsl::Stats* deps = write_deps ? &stats : nullptr;
+
+        if (!cache_dir.empty()) {
+            std::string source;
+            if (!read_file(input, source))
+                throw std::runtime_error("Could not open file: " + input);
+            std::string manifest = manifest_key(input, source, opts);
 
-        if (!output.empty()) {
-            std::ofstream f(output);
-            f << result;
+            std::string result;
+            if (!cache_lookup(cache_dir, manifest, result, stats)) {
+                stats = pre_wgsl::Stats();
+                result = pp.preprocess_file(input, {}, &stats);
+                try {
+                    cache_store(cache_dir, manifest, result, stats);
+                } catch (const std::exception& e) {
+                    // A cache that cannot be written only costs time
+                    std::cerr << "pre-wgsl warning: " << e.what() << "\n";
+                }
+            }
+
+            if (!output.empty()) {
+                std::ofstream f(output, std::ios::binary);
+                f << result;
+            } else {
+                std::cout << result;
+            }
+        } else if (!output.empty()) {
+            // Binary, like the cached path, so both write the same bytes
+            std::ofstream f(output, std::ios::binary);
+            pre_wgsl::OStreamSink sink(f);
+            pp.preprocess_file(input, {}, sink, deps);
         } else {
-            std::cout << result;
+            pre_wgsl::OStreamSink sink(std::cout);
+            pp.preprocess_file(input, {}, sink, deps);
+        }
+
+        if (write_deps) {
+            // Like a compiler: -MD puts output.d next to the output
+            if (depfile.empty())
+                depfile = fs::path(output).replace_extension(".d").string();
+            write_depfile(depfile, output, input, stats.includes);
         }
     } catch (const std::exception& e) {
         std::cerr << "pre-wgsl error: " << e.what() << "\n";
-        return 1;
+        // Output is streamed, so don't leave a partial file behind
+        if (!output.empty())
+            std::remove(output.c_str());
+        status = 1;
+    }
+
+    // A trace of a failed run is still useful
+    if (opts.tracer) {
+        try {
+            opts.tracer->write_file(trace);
+        } catch (const std::exception& e) {
+            std::cerr << "pre-wgsl error: " << e.what() << "\n";
+            status = 1;
+        }
     }
 
-    return 0;
+    return status;
 }
@@ -1,24 +1,273 @@
 #ifndef PRE_WGSL_HPP
 #define PRE_WGSL_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <shared_mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+// Memory-mapped file loading; see SourceBuffer
+#if !defined(PRE_WGSL_NO_MMAP) && !defined(__EMSCRIPTEN__) &&                  \
+    (defined(__unix__) || defined(__APPLE__))
+#define PRE_WGSL_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define PRE_WGSL_MMAP 0
+#endif
+
 namespace pre_wgsl {
 
+class Tracer;
+class IncludeProvider;
+
 //==============================================================
 // Options
 //==============================================================
 struct Options {
+  // #include "name" looks for name next to the including file, then in
+  // include_path, then in each of include_paths in order
   std::string include_path = ".";
+  std::vector<std::string> include_paths;
   std::vector<std::string> macros;
+  // Strip comments and collapse whitespace in the output; ignored by
+  // preprocess_includes(), whose output still has directives
+  bool minify = false;
+  // Leave comments out of the output. Comments are otherwise copied as they
+  // are: identifiers inside them are never expanded.
+  bool drop_comments = false;
+  // Upper bound on bytes of file contents kept by the include cache;
+  // 0 disables caching
+  size_t include_cache_bytes = 64 * 1024 * 1024;
+  // Where #include and the *_file() calls read files from; see
+  // IncludeProvider. By default, from disk through an IncludeCache of
+  // include_cache_bytes.
+  std::shared_ptr<IncludeProvider> include_provider;
+  // Records a trace of every call when set; see Tracer
+  std::shared_ptr<Tracer> tracer;
+};
+
+//==============================================================
+// Statistics
+//
+// Optional per-call counters, phase timings and the files a run depended
+// on. Preprocessing calls take a `Stats *`; when it is null nothing is
+// recorded. Values accumulate, so one Stats can be shared by several calls
+// (but not by concurrent ones).
+//==============================================================
+enum class Directive {
+  Include,
+  Define,
+  Undef,
+  If,
+  Ifdef,
+  Ifndef,
+  Elif,
+  Else,
+  Endif,
+};
+
+struct Stats {
+  uint64_t lines = 0;            // source lines compiled, includes included
+  // Directives reached in active branches, indexed by Directive. A reached
+  // conditional counts its #if, every #elif/#else and its #endif.
+  std::array<uint64_t, 9> directives{};
+  uint64_t macro_expansions = 0; // macro names replaced in the output
+  uint64_t include_bytes = 0;    // size of the files pulled in by #include
+  uint64_t include_cache_hits = 0;
+  uint64_t include_cache_misses = 0;
+
+  std::chrono::nanoseconds io_time{0};         // loading files
+  std::chrono::nanoseconds directive_time{0};  // parsing and applying
+  std::chrono::nanoseconds expression_time{0}; // evaluating #if/#elif
+  std::chrono::nanoseconds expansion_time{0};  // expanding macros in text
+
+  // Normalized paths of the files pulled in by #include directives in
+  // active branches, each once, in the order they were first reached.
+  // Includes that were compiled but never reached are not listed; those
+  // skipped by an include guard or #pragma once are.
+  std::vector<std::string> includes;
+  // Normalized paths searched for those includes, ahead of the file that
+  // was used, where no file existed. Creating one of them would change
+  // which file an #include reads.
+  std::vector<std::string> missing_includes;
+
+  uint64_t directive(Directive d) const {
+    return directives[static_cast<size_t>(d)];
+  }
+};
+
+// Adds the time until it goes out of scope to `*total`, if not null
+class ScopedTimer {
+public:
+  explicit ScopedTimer(std::chrono::nanoseconds *total) : total(total) {
+    if (total)
+      start = std::chrono::steady_clock::now();
+  }
+
+  ~ScopedTimer() {
+    if (total)
+      *total += std::chrono::steady_clock::now() - start;
+  }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  std::chrono::nanoseconds *total;
+  std::chrono::steady_clock::time_point start;
+};
+
+//==============================================================
+// Tracing
+//
+// An opt-in recorder of nested timing spans, written out in the Chrome
+// trace_event JSON format so a run can be inspected in Perfetto or
+// chrome://tracing. Set Options::tracer to record every call made through
+// that Preprocessor; recording is thread-safe.
+//==============================================================
+class Tracer {
+public:
+  Tracer() : origin(std::chrono::steady_clock::now()) {}
+
+  // Records [construction, destruction) as one span. A null tracer makes
+  // this a no-op; `name` must outlive the span.
+  class Span {
+  public:
+    Span(Tracer *tracer, const char *category, std::string_view name)
+        : tracer(tracer), category(category), name(name) {
+      if (tracer)
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~Span() {
+      if (tracer)
+        tracer->record(category, name, start,
+                       std::chrono::steady_clock::now());
+    }
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+  private:
+    Tracer *tracer;
+    const char *category;
+    std::string_view name;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void record(const char *category, std::string_view name,
+              std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end) {
+    auto ns = [](auto d) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(d);
+    };
+    Event e{std::string(name), category, ns(start - origin), ns(end - start),
+            threadId()};
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(std::move(e));
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return events.size();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+  }
+
+  // {"traceEvents": [...]} with one complete ("X") event per span
+  void write(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+      const Event &e = events[i];
+      os << (i ? ",\n" : "\n") << "{\"name\":\"";
+      writeEscaped(os, e.name);
+      os << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"ts\":"
+         << micros(e.start) << ",\"dur\":" << micros(e.duration)
+         << ",\"pid\":1,\"tid\":" << e.tid << "}";
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+  void write_file(const std::string &path) const {
+    std::ofstream f(path);
+    if (!f.is_open())
+      throw std::runtime_error("Could not open file: " + path);
+    write(f);
+  }
+
+private:
+  struct Event {
+    std::string name;
+    const char *category;
+    std::chrono::nanoseconds start; // since `origin`
+    std::chrono::nanoseconds duration;
+    uint32_t tid;
+  };
+
+  std::chrono::steady_clock::time_point origin;
+  mutable std::mutex mutex;
+  std::vector<Event> events;
+
+  // Small, stable per-thread ids read better in the viewer than hashes
+  static uint32_t threadId() {
+    static std::atomic<uint32_t> next{1};
+    thread_local uint32_t id = next++;
+    return id;
+  }
+
+  static std::string micros(std::chrono::nanoseconds ns) {
+    std::string s = std::to_string(ns.count() / 1000);
+    int64_t frac = ns.count() % 1000;
+    s += '.';
+    s += static_cast<char>('0' + frac / 100);
+    s += static_cast<char>('0' + frac / 10 % 10);
+    s += static_cast<char>('0' + frac % 10);
+    return s;
+  }
+
+  static void writeEscaped(std::ostream &os, std::string_view s) {
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        os << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        const char *hex = "0123456789abcdef";
+        os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      } else {
+        os << c;
+      }
+    }
+  }
 };
 
 //==============================================================
@@ -34,17 +283,35 @@ static std::string trim(const std::string &s) {
   return s.substr(a, b - a);
 }
 
-static std::string trim_value(std::istream &is) {
-  std::ostringstream ss;
-  ss << is.rdbuf();
-  return trim(ss.str());
+static std::string_view trimView(std::string_view s) {
+  size_t a = 0;
+  while (a < s.size() && std::isspace((unsigned char)s[a]))
+    a++;
+  size_t b = s.size();
+  while (b > a && std::isspace((unsigned char)s[b - 1]))
+    b--;
+  return s.substr(a, b - a);
+}
+
+// Split off the next whitespace-delimited token, like `istream >> string`
+static std::string_view nextToken(std::string_view &s) {
+  size_t a = 0;
+  while (a < s.size() && std::isspace((unsigned char)s[a]))
+    a++;
+  size_t b = a;
+  while (b < s.size() && !std::isspace((unsigned char)s[b]))
+    b++;
+  std::string_view tok = s.substr(a, b - a);
+  s.remove_prefix(b);
+  return tok;
 }
 
 static bool isIdentChar(char c) {
-  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+         c == '_';
 }
 
-static bool endsWithContinuation(const std::string &line) {
+static bool endsWithContinuation(std::string_view line) {
   size_t i = line.size();
   while (i > 0 && std::isspace((unsigned char)line[i - 1]))
     i--;
@@ -60,72 +327,436 @@ static void stripContinuation(std::string &line) {
   }
 }
 
-static std::string expandMacrosRecursiveInternal(
-    const std::string &line,
-    const std::unordered_map<std::string, std::string> &macros,
-    std::unordered_set<std::string> &visiting);
+//==============================================================
+// Identifier scanning
+//
+// Finds every maximal run of [A-Za-z0-9_] in a block of text. With SSE2 or
+// AVX2 available, 16 or 32 bytes are classified at once into a bit mask and
+// identifier starts/ends are read off the mask's transitions, so long runs
+// of code cost a few instructions per block instead of a branch per byte.
+// Define PRE_WGSL_NO_SIMD to force the portable scalar path.
+//==============================================================
+#if defined(PRE_WGSL_NO_SIMD)
+#define PRE_WGSL_SIMD_WIDTH 0
+#elif defined(__AVX2__)
+#define PRE_WGSL_SIMD_WIDTH 32
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) ||                                  \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PRE_WGSL_SIMD_WIDTH 16
+#include <emmintrin.h>
+#else
+#define PRE_WGSL_SIMD_WIDTH 0
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline unsigned countTrailingZeros(uint64_t v) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward64(&i, v);
+  return static_cast<unsigned>(i);
+#else
+  return static_cast<unsigned>(__builtin_ctzll(v));
+#endif
+}
 
-static std::string
-expandMacroValue(const std::string &name,
-                 const std::unordered_map<std::string, std::string> &macros,
-                 std::unordered_set<std::string> &visiting) {
-  if (visiting.count(name))
-    throw std::runtime_error("Recursive macro: " + name);
-  visiting.insert(name);
+#if PRE_WGSL_SIMD_WIDTH == 32
+// Bit i is set when p[i] is an identifier character
+static inline uint64_t identMask(const char *p) {
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+  // Signed compares: bytes >= 0x80 are negative and never match
+  __m256i digit =
+      _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+  __m256i alpha =
+      _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+  __m256i under = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+  __m256i any = _mm256_or_si256(_mm256_or_si256(digit, alpha), under);
+  return static_cast<uint32_t>(_mm256_movemask_epi8(any));
+}
+#elif PRE_WGSL_SIMD_WIDTH == 16
+static inline uint64_t identMask(const char *p) {
+  __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+  __m128i any = _mm_or_si128(_mm_or_si128(digit, alpha), under);
+  return static_cast<uint32_t>(_mm_movemask_epi8(any));
+}
+#endif
 
-  auto it = macros.find(name);
-  if (it == macros.end()) {
-    visiting.erase(name);
-    return name;
+// Call f(start, length) for every identifier-like token in `text`
+template <typename F>
+static void forEachIdentifier(std::string_view text, F &&f) {
+  const char *p = text.data();
+  size_t n = text.size();
+  size_t i = 0;
+  bool in_ident = false;
+  size_t start = 0;
+
+#if PRE_WGSL_SIMD_WIDTH
+  const size_t width = PRE_WGSL_SIMD_WIDTH;
+  const uint64_t all = (1ull << width) - 1;
+  for (; i + width <= n; i += width) {
+    uint64_t m = identMask(p + i);
+    if (m == (in_ident ? all : 0))
+      continue;
+    uint64_t prev = ((m << 1) | (in_ident ? 1 : 0)) & all;
+    uint64_t starts = m & ~prev;
+    uint64_t ends = ~m & prev & all;
+    // Starts and ends strictly alternate
+    for (;;) {
+      if (!in_ident) {
+        if (!starts)
+          break;
+        start = i + countTrailingZeros(starts);
+        starts &= starts - 1;
+        in_ident = true;
+      } else {
+        if (!ends)
+          break;
+        size_t end = i + countTrailingZeros(ends);
+        ends &= ends - 1;
+        f(start, end - start);
+        in_ident = false;
+      }
+    }
   }
-
-  const std::string &value = it->second;
-  if (value.empty()) {
-    visiting.erase(name);
-    return "";
+#endif
+
+  for (; i < n; i++) {
+    bool ident = isIdentChar(p[i]);
+    if (ident && !in_ident) {
+      start = i;
+      in_ident = true;
+    } else if (!ident && in_ident) {
+      f(start, i - start);
+      in_ident = false;
+    }
   }
-
-  std::string expanded = expandMacrosRecursiveInternal(value, macros, visiting);
-  visiting.erase(name);
-  return expanded;
+  if (in_ident)
+    f(start, n - start);
 }
 
-static std::string expandMacrosRecursiveInternal(
-    const std::string &line,
-    const std::unordered_map<std::string, std::string> &macros,
-    std::unordered_set<std::string> &visiting) {
-  std::string result;
-  result.reserve(line.size());
+//==============================================================
+// Macro table
+//
+// Macro names are interned once into stable storage and indexed by
+// string_view, so probing an identifier straight out of the source text never
+// allocates. #undef only clears a symbol's definition; the symbol itself (and
+// its index) stays for the lifetime of the table.
+//
+// A small filter over the first character and length of every name ever
+// defined in the table rejects most identifiers that cannot be macros before
+// they are hashed.
+//
+// Each symbol also memoizes its fully expanded value. While a value is being
+// expanded, every identifier in it records the symbol as a dependent; a later
+// #define or #undef of that identifier drops the cached expansion of all
+// (transitive) dependents and nothing else.
+//
+// A table may be layered over an immutable base table (the global macros of
+// a Preprocessor) that it never copies as a whole. A base symbol is copied
+// into the table the first time it is looked up or interned, and from then
+// on the copy shadows it; that is also where its expansion is memoized. So
+// setting up a table per call costs O(macros defined in it), and each call
+// pays only for the globals it actually reads.
+//==============================================================
 
+// Fast non-cryptographic hash for identifiers: eight bytes per multiply
+static uint64_t hashName(std::string_view s) {
+  const uint64_t k = 0x9E3779B97F4A7C15ull;
+  uint64_t h = s.size() * k;
   size_t i = 0;
-  while (i < line.size()) {
-    if (isIdentChar(line[i])) {
-      size_t start = i;
-      while (i < line.size() && isIdentChar(line[i])) {
-        i++;
-      }
-      std::string token = line.substr(start, i - start);
+  for (; i + 8 <= s.size(); i += 8) {
+    uint64_t w;
+    std::memcpy(&w, s.data() + i, 8);
+    h = (h ^ w) * k;
+    h ^= h >> 29;
+  }
+  uint64_t tail = 0;
+  for (size_t j = 0; i + j < s.size(); j++)
+    tail |= uint64_t((unsigned char)s[i + j]) << (8 * j);
+  h = (h ^ tail) * k;
+  return h ^ (h >> 32);
+}
 
-      auto it = macros.find(token);
-      if (it != macros.end()) {
-        result += expandMacroValue(token, macros, visiting);
-      } else {
-        result += token;
-      }
-    } else {
-      result += line[i];
-      i++;
+struct NameHash {
+  size_t operator()(std::string_view s) const {
+    return static_cast<size_t>(hashName(s));
+  }
+};
+
+struct CompiledExpr;
+struct Macro;
+
+// Told about every macro lookup while attached to a MacroTable
+class MacroObserver {
+public:
+  virtual ~MacroObserver() = default;
+  // `m` is null if `name` is not currently defined
+  virtual void consulted(std::string_view name, const Macro *m) = 0;
+};
+
+struct Macro {
+  std::string name;
+  std::string value;
+  bool defined = false;
+  // Set for macros passed through Options or per call, which the shader
+  // itself may not #define or #undef
+  bool locked = false;
+  // Set while this macro's value is being expanded, to detect recursion
+  bool visiting = false;
+
+  uint32_t id = 0;
+  // Memoized result of expanding `value`, valid while `expanded` is set
+  bool expanded = false;
+  std::string expansion;
+  // Ids of macros whose memoized expansion read this symbol
+  std::vector<uint32_t> dependents;
+  // `value` compiled as an #if expression, built on first use
+  std::shared_ptr<const CompiledExpr> value_expr;
+};
+
+class MacroTable {
+public:
+  MacroTable() = default;
+  // An empty table over `base`, which must not change and must not have a
+  // base of its own
+  explicit MacroTable(std::shared_ptr<const MacroTable> base)
+      : base(std::move(base)) {
+    if (this->base) {
+      first_chars = this->base->first_chars;
+      lengths = this->base->lengths;
     }
   }
+  MacroTable(const MacroTable &other)
+      : symbols(other.symbols), base(other.base),
+        first_chars(other.first_chars), lengths(other.lengths) {
+    reindex();
+  }
+  MacroTable(MacroTable &&) = default;
+  MacroTable &operator=(const MacroTable &other) {
+    symbols = other.symbols;
+    base = other.base;
+    first_chars = other.first_chars;
+    lengths = other.lengths;
+    reindex();
+    return *this;
+  }
+  MacroTable &operator=(MacroTable &&) = default;
 
-  return result;
-}
+  // Not copied with the table
+  MacroObserver *observer = nullptr;
+
+  // The macro called `name`, or nullptr if it is not currently defined
+  Macro *find(std::string_view name) {
+    Macro *m = lookup(name);
+    if (observer)
+      observer->consulted(name, m);
+    return m;
+  }
+
+  // Never interns, so it is safe on a table shared between threads
+  const Macro *find(std::string_view name) const {
+    const Macro *m = peek(name);
+    if (observer)
+      observer->consulted(name, m);
+    return m;
+  }
+
+  bool contains(std::string_view name) const { return find(name) != nullptr; }
+
+  // The symbol for `name`, created on first use: copied from the base if
+  // it has one, else undefined
+  Macro &intern(std::string_view name) {
+    auto it = index.find(name);
+    if (it != index.end())
+      return symbols[it->second];
+    symbols.emplace_back();
+    Macro &m = symbols.back();
+    m.name = std::string(name);
+    m.id = static_cast<uint32_t>(symbols.size() - 1);
+    if (const Macro *b = base ? base->local(name) : nullptr) {
+      m.value = b->value;
+      m.defined = b->defined;
+      m.locked = b->locked;
+      m.value_expr = b->value_expr;
+    }
+    index.emplace(m.name, m.id);
+    return m;
+  }
+
+  Macro &define(std::string_view name, std::string value) {
+    Macro &m = intern(name);
+    define(m, std::move(value));
+    return m;
+  }
+
+  void define(Macro &m, std::string value) {
+    m.value = std::move(value);
+    m.value_expr.reset();
+    m.defined = true;
+    addToFilter(m.name);
+    invalidate(m);
+  }
+
+  void undef(std::string_view name) {
+    auto it = index.find(name);
+    if (it == index.end())
+      return;
+    Macro &m = symbols[it->second];
+    m.defined = false;
+    invalidate(m);
+  }
+
+  // Report a read of `m` that did not go through find()
+  void consulted(const Macro &m) const {
+    if (observer)
+      observer->consulted(m.name, m.defined ? &m : nullptr);
+  }
+
+  // Record that the memoized expansion of `dependent` read `m`
+  void addDependent(Macro &m, const Macro &dependent) {
+    if (m.dependents.empty() || m.dependents.back() != dependent.id)
+      m.dependents.push_back(dependent.id);
+  }
+
+  // Visit every defined macro, including those only in the base
+  template <typename F> void forEach(F &&f) const {
+    for (const Macro &m : symbols) {
+      if (m.defined)
+        f(m);
+    }
+    if (base) {
+      base->forEach([&](const Macro &m) {
+        if (!index.count(m.name))
+          f(m);
+      });
+    }
+  }
+
+private:
+  // A deque never moves its elements, so the views in `index` stay valid
+  std::deque<Macro> symbols;
+  std::unordered_map<std::string_view, uint32_t, NameHash> index;
+  std::shared_ptr<const MacroTable> base; // may be null
+  // Filter bits: first character (256 bits) and length (capped at 63) of
+  // every name ever defined. Never cleared by #undef, so it may only err
+  // towards a full lookup.
+  std::array<uint64_t, 4> first_chars = {};
+  uint64_t lengths = 0;
+
+  void addToFilter(std::string_view name) {
+    if (name.empty())
+      return;
+    unsigned char c = static_cast<unsigned char>(name[0]);
+    first_chars[c >> 6] |= 1ull << (c & 63);
+    lengths |= 1ull << std::min<size_t>(name.size(), 63);
+  }
+
+  Macro *lookup(std::string_view name) {
+    if (!mayBeDefined(name))
+      return nullptr;
+    auto it = index.find(name);
+    if (it != index.end())
+      return symbols[it->second].defined ? &symbols[it->second] : nullptr;
+    const Macro *b = base ? base->local(name) : nullptr;
+    if (!b || !b->defined)
+      return nullptr;
+    return &intern(name);
+  }
 
-static std::string expandMacrosRecursive(
-    const std::string &line,
-    const std::unordered_map<std::string, std::string> &macros) {
-  std::unordered_set<std::string> visiting;
-  return expandMacrosRecursiveInternal(line, macros, visiting);
+  // Like lookup(), but reads a symbol only in the base where it lives
+  const Macro *peek(std::string_view name) const {
+    if (!mayBeDefined(name))
+      return nullptr;
+    const Macro *m = local(name);
+    if (!m && base)
+      m = base->peek(name);
+    return m && m->defined ? m : nullptr;
+  }
+
+  // This table's own symbol for `name`, not looking in the base
+  const Macro *local(std::string_view name) const {
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : &symbols[it->second];
+  }
+
+  bool mayBeDefined(std::string_view name) const {
+    if (name.empty())
+      return true;
+    unsigned char c = static_cast<unsigned char>(name[0]);
+    return (first_chars[c >> 6] >> (c & 63) & 1) &&
+           (lengths >> std::min<size_t>(name.size(), 63) & 1);
+  }
+
+  // Drop the memoized expansion of `m` and of everything built on it. A
+  // dependent without an expansion needs no visit: whatever used its
+  // expansion would have memoized it first, so it has nothing left to drop.
+  void invalidate(Macro &m) {
+    m.expanded = false;
+    m.expansion.clear();
+    std::vector<uint32_t> dependents = std::move(m.dependents);
+    m.dependents.clear();
+    for (uint32_t id : dependents) {
+      if (symbols[id].expanded)
+        invalidate(symbols[id]);
+    }
+  }
+
+  void reindex() {
+    index.clear();
+    for (size_t i = 0; i < symbols.size(); i++)
+      index.emplace(symbols[i].name, static_cast<uint32_t>(i));
+  }
+};
+
+//==============================================================
+// Macro expansion
+//==============================================================
+// The fully expanded value of `m`, memoized in `m`
+static const std::string &expandMacroValue(Macro &m, MacroTable &macros) {
+  if (m.expanded)
+    return m.expansion;
+  if (m.visiting)
+    throw std::runtime_error("Recursive macro: " + m.name);
+
+  // Every identifier in the value is a dependency, defined or not: defining
+  // it later changes this expansion too.
+  std::string expansion;
+  m.visiting = true;
+  try {
+    std::string_view value = m.value;
+    size_t copied = 0;
+    forEachIdentifier(value, [&](size_t start, size_t len) {
+      Macro &dep = macros.intern(value.substr(start, len));
+      macros.consulted(dep);
+      macros.addDependent(dep, m);
+      if (dep.defined) {
+        expansion.append(value.data() + copied, start - copied);
+        expansion += expandMacroValue(dep, macros);
+        copied = start + len;
+      }
+    });
+    expansion.append(value.data() + copied, value.size() - copied);
+  } catch (...) {
+    m.visiting = false;
+    throw;
+  }
+  m.visiting = false;
+
+  m.expansion = std::move(expansion);
+  m.expanded = true;
+  return m.expansion;
 }
 
 //==============================================================
@@ -196,6 +827,18 @@ public:
     return {END, ""};
   }
 
+  // Lex a whole expression up front. The list always ends with an END token;
+  // anything after an unexpected character is dropped, as the parser would
+  // stop there anyway.
+  static std::vector<Tok> lex(std::string_view sv) {
+    ExprLexer lexer(sv);
+    std::vector<Tok> toks;
+    do {
+      toks.push_back(lexer.next());
+    } while (toks.back().kind != END);
+    return toks;
+  }
+
 private:
   std::string_view src;
   size_t pos;
@@ -207,29 +850,107 @@ private:
 };
 
 //==============================================================
-// Expression Parser (recursive descent)
+// Compiled expressions
+//
+// #if/#elif expressions (and macro values referenced from them) are compiled
+// once into a small stack bytecode by a recursive-descent compiler, then
+// evaluated against any macro table. Operands are evaluated left to right,
+// exactly as the grammar is parsed, so errors surface in the same order. A
+// syntax error compiles to a Fail instruction at the point where it was
+// found and is only raised if the expression is actually evaluated.
 //==============================================================
-class ExprParser {
+class ExprCache;
+
+struct CompiledExpr {
+  enum Op : uint8_t {
+    Const,   // push arg
+    Defined, // push defined(names[arg])
+    Ident,   // push the value of macro names[arg]
+    Fail,    // throw error
+    Not,
+    Neg,
+    Pos,
+    Or,
+    And,
+    Eq,
+    Ne,
+    Lt,
+    Gt,
+    Le,
+    Ge,
+    Shl,
+    Shr,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+  };
+
+  struct Instr {
+    Op op;
+    int32_t arg;
+  };
+
+  std::string source;
+  std::vector<Instr> code;
+  std::vector<std::string> names; // each identifier stored once
+  std::string error;
+  size_t max_depth = 0;
+
+  int evaluate(MacroTable &macros, ExprCache *cache) const;
+};
+
+class ExprCompiler {
 public:
-  ExprParser(std::string_view expr,
-             const std::unordered_map<std::string, std::string> &macros,
-             std::unordered_set<std::string> &visiting)
-      : lex(expr), macros(macros), visiting(visiting) {
+  static std::shared_ptr<const CompiledExpr> compile(std::string_view expr) {
+    auto ce = std::make_shared<CompiledExpr>();
+    ce->source = std::string(expr);
+    ExprCompiler c(*ce);
+    try {
+      c.parseLogicalOr();
+    } catch (const std::runtime_error &e) {
+      ce->error = e.what();
+      c.emit(CompiledExpr::Fail, 0, 0);
+    }
+    return ce;
+  }
+
+private:
+  CompiledExpr &out;
+  std::vector<ExprLexer::Tok> toks;
+  size_t pos = 0;
+  const ExprLexer::Tok *tok = nullptr; // toks always ends with END
+  size_t depth = 0;
+
+  explicit ExprCompiler(CompiledExpr &out)
+      : out(out), toks(ExprLexer::lex(out.source)) {
     advance();
   }
 
-  int parse() { return parseLogicalOr(); }
+  void advance() {
+    if (pos < toks.size())
+      tok = &toks[pos++];
+  }
 
-private:
-  ExprLexer lex;
-  ExprLexer::Tok tok;
-  const std::unordered_map<std::string, std::string> &macros;
-  std::unordered_set<std::string> &visiting;
+  // `pushes` is the net change of the evaluation stack depth
+  void emit(CompiledExpr::Op op, int32_t arg, int pushes) {
+    out.code.push_back({op, arg});
+    depth += pushes;
+    out.max_depth = std::max(out.max_depth, depth);
+  }
 
-  void advance() { tok = lex.next(); }
+  int32_t nameIndex(const std::string &name) {
+    for (size_t i = 0; i < out.names.size(); i++) {
+      if (out.names[i] == name)
+        return static_cast<int32_t>(i);
+    }
+    out.names.push_back(name);
+    return static_cast<int32_t>(out.names.size() - 1);
+  }
 
-  bool acceptOp(const std::string &s) {
-    if (tok.kind == ExprLexer::OP && tok.text == s) {
+  bool acceptOp(const char *s) {
+    if (tok->kind == ExprLexer::OP && tok->text == s) {
       advance();
       return true;
     }
@@ -237,549 +958,2430 @@ private:
   }
 
   bool acceptKind(ExprLexer::Kind k) {
-    if (tok.kind == k) {
+    if (tok->kind == k) {
       advance();
       return true;
     }
     return false;
   }
 
-  int parseLogicalOr() {
-    int v = parseLogicalAnd();
-    while (acceptOp("||")) {
-      int rhs = parseLogicalAnd();
-      v = (v || rhs);
+  // One precedence level: operand (op operand)*
+  template <size_t N, typename Next>
+  void binaryLevel(const char *const (&ops)[N],
+                   const CompiledExpr::Op (&codes)[N], Next next) {
+    (this->*next)();
+    for (;;) {
+      size_t i = 0;
+      while (i < N && !acceptOp(ops[i]))
+        i++;
+      if (i == N)
+        break;
+      (this->*next)();
+      emit(codes[i], 0, -1);
     }
-    return v;
   }
 
-  int parseLogicalAnd() {
-    int v = parseEquality();
-    while (acceptOp("&&")) {
-      int rhs = parseEquality();
-      v = (v && rhs);
-    }
-    return v;
+  void parseLogicalOr() {
+    binaryLevel({"||"}, {CompiledExpr::Or}, &ExprCompiler::parseLogicalAnd);
   }
 
-  int parseEquality() {
-    int v = parseRelational();
-    for (;;) {
-      if (acceptOp("==")) {
-        int rhs = parseRelational();
-        v = (v == rhs);
-      } else if (acceptOp("!=")) {
-        int rhs = parseRelational();
-        v = (v != rhs);
-      } else
-        break;
-    }
-    return v;
+  void parseLogicalAnd() {
+    binaryLevel({"&&"}, {CompiledExpr::And}, &ExprCompiler::parseEquality);
   }
 
-  int parseRelational() {
-    int v = parseShift();
-    for (;;) {
-      if (acceptOp("<")) {
-        int rhs = parseShift();
-        v = (v < rhs);
-      } else if (acceptOp(">")) {
-        int rhs = parseShift();
-        v = (v > rhs);
-      } else if (acceptOp("<=")) {
-        int rhs = parseShift();
-        v = (v <= rhs);
-      } else if (acceptOp(">=")) {
-        int rhs = parseShift();
-        v = (v >= rhs);
-      } else
-        break;
-    }
-    return v;
+  void parseEquality() {
+    binaryLevel({"==", "!="}, {CompiledExpr::Eq, CompiledExpr::Ne},
+                &ExprCompiler::parseRelational);
   }
 
-  int parseShift() {
-    int v = parseAdd();
-    for (;;) {
-      if (acceptOp("<<")) {
-        int rhs = parseAdd();
-        v = (v << rhs);
-      } else if (acceptOp(">>")) {
-        int rhs = parseAdd();
-        v = (v >> rhs);
-      } else
-        break;
-    }
-    return v;
+  void parseRelational() {
+    binaryLevel({"<", ">", "<=", ">="},
+                {CompiledExpr::Lt, CompiledExpr::Gt, CompiledExpr::Le,
+                 CompiledExpr::Ge},
+                &ExprCompiler::parseShift);
   }
 
-  int parseAdd() {
-    int v = parseMult();
-    for (;;) {
-      if (acceptOp("+")) {
-        int rhs = parseMult();
-        v = (v + rhs);
-      } else if (acceptOp("-")) {
-        int rhs = parseMult();
-        v = (v - rhs);
-      } else
-        break;
-    }
-    return v;
+  void parseShift() {
+    binaryLevel({"<<", ">>"}, {CompiledExpr::Shl, CompiledExpr::Shr},
+                &ExprCompiler::parseAdd);
   }
 
-  int parseMult() {
-    int v = parseUnary();
-    for (;;) {
-      if (acceptOp("*")) {
-        int rhs = parseUnary();
-        v = (v * rhs);
-      } else if (acceptOp("/")) {
-        int rhs = parseUnary();
-        v = (rhs == 0 ? 0 : v / rhs);
-      } else if (acceptOp("%")) {
-        int rhs = parseUnary();
-        v = (rhs == 0 ? 0 : v % rhs);
-      } else
-        break;
-    }
-    return v;
+  void parseAdd() {
+    binaryLevel({"+", "-"}, {CompiledExpr::Add, CompiledExpr::Sub},
+                &ExprCompiler::parseMult);
   }
 
-  int parseUnary() {
-    if (acceptOp("!"))
-      return !parseUnary();
-    if (acceptOp("-"))
-      return -parseUnary();
-    if (acceptOp("+"))
-      return +parseUnary();
-    return parsePrimary();
+  void parseMult() {
+    binaryLevel({"*", "/", "%"},
+                {CompiledExpr::Mul, CompiledExpr::Div, CompiledExpr::Mod},
+                &ExprCompiler::parseUnary);
   }
 
-  int parsePrimary() {
+  void parseUnary() {
+    if (acceptOp("!")) {
+      parseUnary();
+      emit(CompiledExpr::Not, 0, 0);
+    } else if (acceptOp("-")) {
+      parseUnary();
+      emit(CompiledExpr::Neg, 0, 0);
+    } else if (acceptOp("+")) {
+      parseUnary();
+      emit(CompiledExpr::Pos, 0, 0);
+    } else {
+      parsePrimary();
+    }
+  }
+
+  void parsePrimary() {
     // '(' expr ')'
     if (acceptKind(ExprLexer::LPAREN)) {
-      int v = parse();
+      parseLogicalOr();
       if (!acceptKind(ExprLexer::RPAREN))
         throw std::runtime_error("missing ')'");
-      return v;
+      return;
     }
 
     // number
-    if (tok.kind == ExprLexer::NUMBER) {
-      int v = std::stoi(tok.text);
+    if (tok->kind == ExprLexer::NUMBER) {
+      errno = 0;
+      long v = std::strtol(tok->text.c_str(), nullptr, 10);
+      if (errno == ERANGE || v > INT32_MAX)
+        throw std::runtime_error("integer literal out of range: " +
+                                 tok->text);
       advance();
-      return v;
+      emit(CompiledExpr::Const, static_cast<int32_t>(v), 1);
+      return;
     }
 
     // defined(identifier)
-    if (tok.kind == ExprLexer::IDENT && tok.text == "defined") {
+    if (tok->kind == ExprLexer::IDENT && tok->text == "defined") {
       advance();
       if (acceptKind(ExprLexer::LPAREN)) {
-        if (tok.kind != ExprLexer::IDENT)
+        if (tok->kind != ExprLexer::IDENT)
           throw std::runtime_error("expected identifier in defined()");
-        std::string name = tok.text;
+        int32_t name = nameIndex(tok->text);
         advance();
         if (!acceptKind(ExprLexer::RPAREN))
           throw std::runtime_error("missing ) in defined()");
-        return macros.count(name) ? 1 : 0;
+        emit(CompiledExpr::Defined, name, 1);
       } else {
         // defined NAME
-        if (tok.kind != ExprLexer::IDENT)
+        if (tok->kind != ExprLexer::IDENT)
           throw std::runtime_error("expected identifier in defined NAME");
-        std::string name = tok.text;
+        int32_t name = nameIndex(tok->text);
         advance();
-        return macros.count(name) ? 1 : 0;
+        emit(CompiledExpr::Defined, name, 1);
       }
+      return;
     }
 
     // identifier -> treat as integer, if defined use its value else 0
-    if (tok.kind == ExprLexer::IDENT) {
-      std::string name = tok.text;
+    if (tok->kind == ExprLexer::IDENT) {
+      int32_t name = nameIndex(tok->text);
       advance();
-      auto it = macros.find(name);
-      if (it == macros.end())
-        return 0;
-      if (it->second.empty())
-        return 1;
-      return evalMacroExpression(name, it->second);
+      emit(CompiledExpr::Ident, name, 1);
+      return;
     }
 
     // unexpected
-    return 0;
-  }
-
-  int evalMacroExpression(const std::string &name, const std::string &value) {
-    if (visiting.count(name))
-      throw std::runtime_error("Recursive macro: " + name);
-
-    visiting.insert(name);
-    ExprParser ep(value, macros, visiting);
-    int v = ep.parse();
-    visiting.erase(name);
-    return v;
+    emit(CompiledExpr::Const, 0, 1);
   }
 };
 
 //==============================================================
-// Preprocessor
+// Expression cache
+//
+// Compiled expressions keyed by their source text, shared by every template
+// compiled by one Preprocessor and safe to use from many threads. Lookups
+// take a shared lock and do not allocate.
 //==============================================================
-class Preprocessor {
+class ExprCache {
 public:
-  explicit Preprocessor(Options opts = {}) : opts_(std::move(opts)) {
-    // Treat empty include path as current directory
-    if (opts_.include_path.empty()) {
-      opts_.include_path = ".";
+  explicit ExprCache(size_t max_entries = 4096) : max_entries(max_entries) {}
+
+  std::shared_ptr<const CompiledExpr> get(std::string_view text) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      auto it = entries.find(text);
+      if (it != entries.end())
+        return it->second;
     }
-    parseMacroDefinitions(opts_.macros);
-  }
-
-  std::string
-  preprocess_file(const std::string &filename,
-                  const std::vector<std::string> &additional_macros = {}) {
-    std::unordered_map<std::string, std::string> macros;
-    std::unordered_set<std::string> predefined;
-    std::unordered_set<std::string> include_stack;
-    buildMacros(additional_macros, macros, predefined);
-
-    std::string result = processFile(filename, macros, predefined,
-                                     include_stack, DirectiveMode::All);
-    return result;
-  }
-
-  std::string
-  preprocess(const std::string &contents,
-             const std::vector<std::string> &additional_macros = {}) {
-    std::unordered_map<std::string, std::string> macros;
-    std::unordered_set<std::string> predefined;
-    std::unordered_set<std::string> include_stack;
-    buildMacros(additional_macros, macros, predefined);
-
-    std::string result = processString(contents, macros, predefined,
-                                       include_stack, DirectiveMode::All);
-    return result;
+    std::shared_ptr<const CompiledExpr> ce = ExprCompiler::compile(text);
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    // A simple cap: variant sweeps reuse a bounded set of expressions, so
+    // starting over is cheaper than tracking recency on every hit
+    if (entries.size() >= max_entries)
+      entries.clear();
+    // Keyed by a view of the entry's own source text
+    return entries.emplace(ce->source, ce).first->second;
   }
 
-  std::string preprocess_includes_file(const std::string &filename) {
-    std::unordered_map<std::string, std::string> macros;
-    std::unordered_set<std::string> predefined;
-    std::unordered_set<std::string> include_stack;
-    std::string result =
-        processFile(filename, macros, predefined, include_stack,
-                    DirectiveMode::IncludesOnly);
-    return result;
-  }
-
-  std::string preprocess_includes(const std::string &contents) {
-    std::unordered_map<std::string, std::string> macros;
-    std::unordered_set<std::string> predefined;
-    std::unordered_set<std::string> include_stack;
-    std::string result =
-        processString(contents, macros, predefined, include_stack,
-                      DirectiveMode::IncludesOnly);
-    return result;
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return entries.size();
   }
 
 private:
-  Options opts_;
-  std::unordered_map<std::string, std::string> global_macros;
-
-  enum class DirectiveMode { All, IncludesOnly };
+  size_t max_entries;
+  mutable std::shared_mutex mutex;
+  std::unordered_map<std::string_view, std::shared_ptr<const CompiledExpr>,
+                     NameHash>
+      entries;
+};
 
-  struct Cond {
-    bool parent_active;
-    bool active;
-    bool taken;
-  };
+static std::shared_ptr<const CompiledExpr> compileExpr(std::string_view text,
+                                                       ExprCache *cache) {
+  return cache ? cache->get(text) : ExprCompiler::compile(text);
+}
 
-  //----------------------------------------------------------
-  // Parse macro definitions into global_macros
-  //----------------------------------------------------------
-  void parseMacroDefinitions(const std::vector<std::string> &macro_defs) {
-    for (const auto &def : macro_defs) {
-      size_t eq_pos = def.find('=');
-      if (eq_pos != std::string::npos) {
-        // Format: NAME=VALUE
-        std::string name = trim(def.substr(0, eq_pos));
-        std::string value = trim(def.substr(eq_pos + 1));
-        global_macros[name] = value;
-      } else {
-        // Format: NAME
-        std::string name = trim(def);
-        global_macros[name] = "";
+inline int CompiledExpr::evaluate(MacroTable &macros, ExprCache *cache) const {
+  int small[16];
+  std::vector<int> large;
+  int *stack = small;
+  if (max_depth > 16) {
+    large.resize(max_depth);
+    stack = large.data();
+  }
+  size_t sp = 0;
+
+  for (const Instr &in : code) {
+    switch (in.op) {
+    case Const:
+      stack[sp++] = in.arg;
+      continue;
+    case Defined:
+      stack[sp++] = macros.contains(names[in.arg]) ? 1 : 0;
+      continue;
+    case Ident: {
+      Macro *m = macros.find(names[in.arg]);
+      int v = 0;
+      if (m && m->value.empty()) {
+        v = 1;
+      } else if (m) {
+        if (m->visiting)
+          throw std::runtime_error("Recursive macro: " + m->name);
+        if (!m->value_expr)
+          m->value_expr = compileExpr(m->value, cache);
+        // Keep the compiled value alive even if evaluation redefines nothing
+        std::shared_ptr<const CompiledExpr> value_expr = m->value_expr;
+        m->visiting = true;
+        try {
+          v = value_expr->evaluate(macros, cache);
+        } catch (...) {
+          m->visiting = false;
+          throw;
+        }
+        m->visiting = false;
       }
+      stack[sp++] = v;
+      continue;
+    }
+    case Fail:
+      throw std::runtime_error(error);
+    case Not:
+      stack[sp - 1] = !stack[sp - 1];
+      continue;
+    case Neg:
+      stack[sp - 1] = -stack[sp - 1];
+      continue;
+    case Pos:
+      continue;
+    default:
+      break;
+    }
+
+    int rhs = stack[--sp];
+    int &v = stack[sp - 1];
+    switch (in.op) {
+    case Or:
+      v = (v || rhs);
+      break;
+    case And:
+      v = (v && rhs);
+      break;
+    case Eq:
+      v = (v == rhs);
+      break;
+    case Ne:
+      v = (v != rhs);
+      break;
+    case Lt:
+      v = (v < rhs);
+      break;
+    case Gt:
+      v = (v > rhs);
+      break;
+    case Le:
+      v = (v <= rhs);
+      break;
+    case Ge:
+      v = (v >= rhs);
+      break;
+    case Shl:
+      v = (v << rhs);
+      break;
+    case Shr:
+      v = (v >> rhs);
+      break;
+    case Add:
+      v = (v + rhs);
+      break;
+    case Sub:
+      v = (v - rhs);
+      break;
+    case Mul:
+      v = (v * rhs);
+      break;
+    case Div:
+      v = (rhs == 0 ? 0 : v / rhs);
+      break;
+    case Mod:
+      v = (rhs == 0 ? 0 : v % rhs);
+      break;
+    default:
+      break;
     }
   }
+  return sp ? stack[sp - 1] : 0;
+}
 
-  //----------------------------------------------------------
-  // Build combined macro map and predefined set for a preprocessing operation
-  //----------------------------------------------------------
-  void buildMacros(const std::vector<std::string> &additional_macros,
-                   std::unordered_map<std::string, std::string> &macros,
-                   std::unordered_set<std::string> &predefined) {
-    macros = global_macros;
-    predefined.clear();
+//==============================================================
+// Output sinks
+//
+// Preprocessed output is streamed into a Sink as it is produced; text from
+// every include level goes straight to the same sink.
+//==============================================================
+class Sink {
+public:
+  virtual ~Sink() = default;
+  virtual void write(std::string_view data) = 0;
+  // Hint that about `bytes` more bytes are coming
+  virtual void reserve(size_t bytes) { (void)bytes; }
+};
 
-    for (const auto &[name, value] : global_macros) {
-      predefined.insert(name);
-    }
+// Appends to a caller-owned string
+class StringSink final : public Sink {
+public:
+  explicit StringSink(std::string &out) : out(out) {}
+  void write(std::string_view data) override { out.append(data); }
+  void reserve(size_t bytes) override { out.reserve(out.size() + bytes); }
 
-    for (const auto &def : additional_macros) {
-      size_t eq_pos = def.find('=');
-      std::string name, value;
-      if (eq_pos != std::string::npos) {
-        name = trim(def.substr(0, eq_pos));
-        value = trim(def.substr(eq_pos + 1));
-      } else {
-        name = trim(def);
-        value = "";
-      }
+private:
+  std::string &out;
+};
 
-      // Add to macros map (will override global if same name)
-      macros[name] = value;
-      predefined.insert(name);
-    }
+// Writes to a std::ostream, e.g. an output file
+class OStreamSink final : public Sink {
+public:
+  explicit OStreamSink(std::ostream &os) : os(os) {}
+  void write(std::string_view data) override {
+    os.write(data.data(), static_cast<std::streamsize>(data.size()));
   }
 
-  //----------------------------------------------------------
-  // Helpers
-  //----------------------------------------------------------
-  std::string loadFile(const std::string &fname) {
-    std::ifstream f(fname);
-    if (!f.is_open())
-      throw std::runtime_error("Could not open file: " + fname);
-    std::stringstream ss;
-    ss << f.rdbuf();
-    return ss.str();
+private:
+  std::ostream &os;
+};
+
+// Hands every chunk to a callback
+class CallbackSink final : public Sink {
+public:
+  explicit CallbackSink(std::function<void(std::string_view)> fn)
+      : fn(std::move(fn)) {}
+  void write(std::string_view data) override { fn(data); }
+
+private:
+  std::function<void(std::string_view)> fn;
+};
+
+//==============================================================
+// Output hashing
+//
+// Streaming XXH64: the digest of the output is the same however it was
+// split into writes, and equals hash64() of the whole text. Stable across
+// platforms and releases, so it can key persistent pipeline caches.
+//==============================================================
+class Hasher64 {
+public:
+  explicit Hasher64(uint64_t seed = 0) : seed(seed) { reset(); }
+
+  void reset() {
+    acc = {seed + P1 + P2, seed + P2, seed, seed - P1};
+    total = 0;
+    buffered = 0;
   }
 
-  bool condActive(const std::vector<Cond> &cond) const {
-    if (cond.empty())
-      return true;
-    return cond.back().active;
+  void update(std::string_view data) {
+    auto p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t n = data.size();
+    total += n;
+
+    if (buffered) {
+      size_t take = std::min(n, buffer.size() - buffered);
+      std::memcpy(buffer.data() + buffered, p, take);
+      buffered += take;
+      p += take;
+      n -= take;
+      if (buffered < buffer.size())
+        return;
+      consume(buffer.data());
+      buffered = 0;
+    }
+    for (; n >= 32; p += 32, n -= 32)
+      consume(p);
+    std::memcpy(buffer.data(), p, n);
+    buffered = n;
   }
 
-  //----------------------------------------------------------
-  // Process a file
-  //----------------------------------------------------------
-  std::string
-  processFile(const std::string &name,
-              std::unordered_map<std::string, std::string> &macros,
-              const std::unordered_set<std::string> &predefined_macros,
-              std::unordered_set<std::string> &include_stack,
-              DirectiveMode mode) {
-    if (include_stack.count(name))
-      throw std::runtime_error("Recursive include: " + name);
-
-    include_stack.insert(name);
-    std::string shader_code = loadFile(name);
-    std::string out = processString(shader_code, macros, predefined_macros,
-                                    include_stack, mode);
-    include_stack.erase(name);
-    return out;
+  uint64_t digest() const {
+    uint64_t h;
+    if (total >= 32) {
+      h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) +
+          rotl(acc[3], 18);
+      for (uint64_t v : acc)
+        h = (h ^ round(0, v)) * P1 + P4;
+    } else {
+      h = seed + P5;
+    }
+    h += total;
+
+    const unsigned char *p = buffer.data();
+    size_t n = buffered;
+    for (; n >= 8; p += 8, n -= 8)
+      h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (n >= 4) {
+      h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+      p += 4;
+      n -= 4;
+    }
+    for (; n > 0; p++, n--)
+      h = rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
   }
 
-  std::string
-  processIncludeFile(const std::string &fname,
-                     std::unordered_map<std::string, std::string> &macros,
-                     const std::unordered_set<std::string> &predefined_macros,
-                     std::unordered_set<std::string> &include_stack,
-                     DirectiveMode mode) {
-    std::string full_path = opts_.include_path + "/" + fname;
-    return processFile(full_path, macros, predefined_macros, include_stack,
-                       mode);
+private:
+  static constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+  static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+  static constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+  static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+  static constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+  uint64_t seed;
+  std::array<uint64_t, 4> acc;
+  uint64_t total;
+  std::array<unsigned char, 32> buffer;
+  size_t buffered;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+  static uint64_t round(uint64_t a, uint64_t input) {
+    return rotl(a + input * P2, 31) * P1;
   }
 
-  //----------------------------------------------------------
-  // Process text
-  //----------------------------------------------------------
-  std::string
-  processString(const std::string &shader_code,
-                std::unordered_map<std::string, std::string> &macros,
-                const std::unordered_set<std::string> &predefined_macros,
-                std::unordered_set<std::string> &include_stack,
-                DirectiveMode mode) {
-    std::vector<Cond> cond; // Conditional stack for this shader
-    std::stringstream out;
-    std::istringstream in(shader_code);
-    std::string line;
-
-    while (std::getline(in, line)) {
-      std::string logical = line;
-      std::string t = trim(logical);
-      if (!t.empty() && t[0] == '#') {
+  // Little-endian loads, whatever the host byte order
+  static uint64_t read64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+      v = (v << 8) | p[i];
+    return v;
+  }
+
+  static uint64_t read32(const unsigned char *p) {
+    return uint64_t(p[0]) | uint64_t(p[1]) << 8 | uint64_t(p[2]) << 16 |
+           uint64_t(p[3]) << 24;
+  }
+
+  void consume(const unsigned char *p) {
+    for (int i = 0; i < 4; i++)
+      acc[i] = round(acc[i], read64(p + 8 * i));
+  }
+};
+
+inline uint64_t hash64(std::string_view data, uint64_t seed = 0) {
+  Hasher64 h(seed);
+  h.update(data);
+  return h.digest();
+}
+
+// Hashes everything written to it and passes it on to `next`, if any. With
+// no `next` the output is never materialized.
+class HashSink final : public Sink {
+public:
+  explicit HashSink(uint64_t seed = 0, Sink *next = nullptr)
+      : hasher(seed), next(next) {}
+
+  void write(std::string_view data) override {
+    hasher.update(data);
+    if (next)
+      next->write(data);
+  }
+
+  void reserve(size_t bytes) override {
+    if (next)
+      next->reserve(bytes);
+  }
+
+  uint64_t digest() const { return hasher.digest(); }
+
+private:
+  Hasher64 hasher;
+  Sink *next;
+};
+
+//==============================================================
+// Minification
+//
+// Strips comments and collapses whitespace from a stream of WGSL before it
+// reaches the next sink. Works chunk by chunk, so it runs inside the output
+// pass; state (an open comment, a '/' that may start one) carries over
+// between writes. A whitespace run or comment becomes a single space only
+// where dropping it would merge two tokens: between identifier/number
+// characters, or between operator characters ("a - -b", "a / *p", "> >").
+// WGSL has no string literals, so nothing else needs protecting. Block
+// comments nest, as in WGSL.
+//==============================================================
+class MinifySink final : public Sink {
+public:
+  explicit MinifySink(Sink &next) : next(next) {}
+
+  void write(std::string_view data) override {
+    size_t i = 0;
+    const size_t n = data.size();
+    while (i < n) {
+      char c = data[i];
+      switch (state) {
+      case State::Code: {
+        size_t j = i;
+        while (j < n && classOf(data[j]) < Space)
+          j++;
+        if (j > i) {
+          emit(data.substr(i, j - i));
+          i = j;
+        } else {
+          if (c == '/')
+            state = State::Slash;
+          else
+            space = true;
+          i++;
+        }
+        break;
+      }
+      case State::Slash:
+        if (c == '/') {
+          state = State::LineComment;
+          i++;
+        } else if (c == '*') {
+          state = State::BlockComment;
+          depth = 1;
+          prev = 0;
+          i++;
+        } else {
+          // A division; `c` is handled in the Code state
+          state = State::Code;
+          emit("/");
+        }
+        break;
+      case State::LineComment: {
+        const void *nl = std::memchr(data.data() + i, '\n', n - i);
+        if (!nl) {
+          i = n;
+          break;
+        }
+        i = static_cast<size_t>(static_cast<const char *>(nl) - data.data());
+        state = State::Code;
+        space = true;
+        i++;
+        break;
+      }
+      case State::BlockComment:
+        if (prev == '*' && c == '/') {
+          c = 0;
+          if (--depth == 0) {
+            state = State::Code;
+            space = true;
+          }
+        } else if (prev == '/' && c == '*') {
+          c = 0;
+          depth++;
+        }
+        prev = c;
+        i++;
+        break;
+      }
+    }
+    if (!buffer.empty()) {
+      next.write(buffer);
+      buffer.clear();
+    }
+  }
+
+  void reserve(size_t bytes) override { next.reserve(bytes); }
+
+  // Write out a trailing '/' and end the output with a newline
+  void finish() {
+    if (state == State::Slash)
+      emit("/");
+    state = State::Code;
+    if (last)
+      buffer += '\n';
+    next.write(buffer);
+    buffer.clear();
+    last = 0;
+    space = false;
+  }
+
+private:
+  enum class State { Code, Slash, LineComment, BlockComment };
+
+  Sink &next;
+  State state = State::Code;
+  bool space = false; // whitespace or a comment since the last token
+  char last = 0;      // last character written, 0 at the start
+  char prev = 0;      // previous character inside a block comment
+  int depth = 0;      // block comment nesting
+  std::string buffer; // output of the current write(), passed on in one go
+
+  // Character classes; tokens run until the first Space or Slash. Bytes of
+  // UTF-8 sequences count as Ident, as WGSL identifiers may be Unicode.
+  enum Class : unsigned char { Other, Ident, Operator, Space, Slash };
+
+  static constexpr std::array<Class, 256> makeClasses() {
+    std::array<Class, 256> t{};
+    for (int i = 0; i < 256; i++) {
+      if ((i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') ||
+          (i >= '0' && i <= '9') || i == '_' || i >= 0x80)
+        t[i] = Ident;
+    }
+    for (char c : {' ', '\n', '\t', '\r', '\v', '\f'})
+      t[static_cast<unsigned char>(c)] = Space;
+    for (char c : {'+', '-', '*', '%', '&', '|', '^', '<', '>', '=', '!'})
+      t[static_cast<unsigned char>(c)] = Operator;
+    t['/'] = Slash;
+    return t;
+  }
+
+  static Class classOf(char c) {
+    static constexpr std::array<Class, 256> table = makeClasses();
+    return table[static_cast<unsigned char>(c)];
+  }
+
+  // Whether a separator is needed between `a` and `b`; '/' is an operator
+  static bool joins(char a, char b) {
+    Class ca = classOf(a) == Slash ? Operator : classOf(a);
+    Class cb = classOf(b) == Slash ? Operator : classOf(b);
+    return ca == cb && (ca == Ident || ca == Operator);
+  }
+
+  void emit(std::string_view token) {
+    if (space && last && joins(last, token[0]))
+      buffer += ' ';
+    space = false;
+    buffer += token;
+    last = token.back();
+  }
+};
+
+//==============================================================
+// Parsed source
+//
+// A shader is split into lines, trimmed and classified exactly once. The
+// resulting tree can then be evaluated against any number of macro sets
+// without touching the raw text again.
+//==============================================================
+enum class DirectiveMode { All, IncludesOnly };
+
+// Offset and length of an identifier-like token inside a text node
+struct Span {
+  uint32_t pos;
+  uint32_t len;
+};
+
+struct Branch;
+
+struct Node {
+  enum Kind { Text, Include, Define, Undef, Cond, Once };
+
+  Kind kind;
+  // Text: source lines; Include: file; Define/Undef: name. Points into the
+  // parsed source, or into ParsedSource::owned when it is not a slice of it.
+  std::string_view text;
+  std::string value; // Define: macro value
+  std::vector<Branch> branches; // Cond: #if/#ifdef/#ifndef, #elif..., #else
+  std::vector<Span> idents;     // Text: candidate macro names in `text`
+  size_t include = 0;           // Include: position among the #includes
+};
+
+struct Branch {
+  enum Kind { Ifdef, Ifndef, If, Else };
+
+  Kind kind;
+  std::string arg; // Ifdef/Ifndef: macro name; If: expression
+  std::shared_ptr<const CompiledExpr> expr; // If: compiled `arg`
+  std::vector<Node> body;
+};
+
+// Splits code into comment and non-comment spans. The depth of an open
+// block comment (they nest in WGSL) carries over between calls, so a comment
+// may span lines and text nodes.
+class CommentScanner {
+public:
+  // Calls code(start, len) and comment(start, len, line) for consecutive
+  // spans; `line` is true for // comments
+  template <typename Code, typename Comment>
+  void scan(std::string_view text, Code &&code, Comment &&comment) {
+    size_t i = 0;
+    const size_t n = text.size();
+    while (i < n) {
+      if (depth > 0) {
+        size_t end = blockEnd(text, i);
+        comment(i, end - i, false);
+        i = end;
+        continue;
+      }
+      size_t open = findOpen(text, i);
+      if (open > i)
+        code(i, open - i);
+      if (open == n)
+        break;
+      if (text[open + 1] == '/') {
+        size_t nl = text.find('\n', open);
+        size_t end = nl == std::string_view::npos ? n : nl;
+        comment(open, end - open, true);
+        i = end;
+      } else {
+        depth = 1;
+        size_t end = blockEnd(text, open + 2);
+        comment(open, end - open, false);
+        i = end;
+      }
+    }
+  }
+
+  // Whether a block comment is still open
+  bool inComment() const { return depth > 0; }
+
+private:
+  int depth = 0;
+
+  // The next "//" or "/*" at or after `i`, or text.size()
+  static size_t findOpen(std::string_view text, size_t i) {
+    for (;;) {
+      i = text.find('/', i);
+      if (i == std::string_view::npos || i + 1 >= text.size())
+        return text.size();
+      if (text[i + 1] == '/' || text[i + 1] == '*')
+        return i;
+      i++;
+    }
+  }
+
+  // Just past the end of the open block comment, or text.size()
+  size_t blockEnd(std::string_view text, size_t i) {
+    while (i + 1 < text.size()) {
+      if (text[i] == '*' && text[i + 1] == '/') {
+        i += 2;
+        if (--depth == 0)
+          return i;
+      } else if (text[i] == '/' && text[i + 1] == '*') {
+        i += 2;
+        depth++;
+      } else {
+        i++;
+      }
+    }
+    return text.size();
+  }
+};
+
+// `text` without comments. Block comments become their newlines, or one
+// space if they have none, so neither tokens nor lines merge.
+static std::string stripComments(std::string_view text,
+                                 CommentScanner &scanner) {
+  std::string out;
+  out.reserve(text.size());
+  scanner.scan(
+      text, [&](size_t start, size_t len) { out.append(text, start, len); },
+      [&](size_t start, size_t len, bool line) {
+        if (line)
+          return; // the newline after it is code
+        size_t lines = std::count(text.begin() + start,
+                                  text.begin() + start + len, '\n');
+        if (lines)
+          out.append(lines, '\n');
+        else
+          out += ' ';
+      });
+  return out;
+}
+
+class SourceParser {
+public:
+  // Nodes point into `shader_code`, and into `owned` for text that is not
+  // a slice of it; both must outlive them
+  SourceParser(std::string_view shader_code, std::deque<std::string> &owned,
+               DirectiveMode mode, ExprCache *exprs = nullptr,
+               Stats *stats = nullptr, bool drop_comments = false)
+      : src(shader_code), owned(owned), mode(mode), exprs(exprs),
+        stats(stats), drop_comments(drop_comments) {}
+
+  std::vector<Node> parse() {
+    std::vector<Node> root;
+    // Each open conditional keeps a pointer to the node list that the next
+    // line should be appended to.
+    scopes = {&root};
+    std::vector<Node *> open;
+    // Only used for directives continued with a backslash
+    std::string logical;
+
+    while (pos < src.size()) {
+      size_t line_start = pos;
+      std::string_view line = nextLine();
+      std::string_view t = trimView(line);
+
+      if (t.empty() || t[0] != '#') {
+        // Plain code: extend the pending run of verbatim source bytes
+        if (run_end != line_start)
+          flushRun();
+        if (pos > line_start + line.size()) {
+          if (run_start == run_end)
+            run_start = line_start;
+          run_end = pos;
+        } else {
+          // Last line without a trailing newline
+          flushRun();
+          appendText(line);
+        }
+        continue;
+      }
+      flushRun();
+      ScopedTimer timer(stats ? &stats->directive_time : nullptr);
+
+      if (endsWithContinuation(line)) {
+        logical.assign(line);
         while (endsWithContinuation(logical)) {
           stripContinuation(logical);
-          if (!std::getline(in, line))
+          if (pos >= src.size())
             break;
           logical += "\n";
-          logical += line;
+          logical += nextLine();
         }
-        t = trim(logical);
+        line = logical;
+        t = trimView(line);
       }
 
-      if (!t.empty() && t[0] == '#') {
-        bool handled = handleDirective(t, out, macros, predefined_macros, cond,
-                                       include_stack, mode);
-        if (mode == DirectiveMode::IncludesOnly && !handled) {
-          out << logical << "\n";
+      std::vector<Node> &body = *scopes.back();
+      std::string_view rest = t.substr(1);
+      std::string_view cmd = nextToken(rest);
+
+      if (cmd == "include") {
+        std::string_view file = nextToken(rest);
+        if (file.size() >= 2 && file.front() == '"' && file.back() == '"')
+          file = file.substr(1, file.size() - 2);
+        body.push_back(makeNode(Node::Include, keep(file)));
+        body.back().include = includes++;
+        continue;
+      }
+
+      // Takes effect only if reached, like any directive in a branch.
+      // IncludesOnly keeps conditionals as text, so one inside them is
+      // left for whoever evaluates the output.
+      if (cmd == "pragma" && defineValue(rest) == "once" &&
+          text_conditionals == 0) {
+        body.push_back(makeNode(Node::Once));
+        continue;
+      }
+
+      if (mode == DirectiveMode::IncludesOnly) {
+        if (cmd == "if" || cmd == "ifdef" || cmd == "ifndef")
+          text_conditionals++;
+        else if (cmd == "endif" && text_conditionals > 0)
+          text_conditionals--;
+        appendText(line);
+        continue;
+      }
+
+      if (cmd == "define") {
+        std::string_view name = nextToken(rest);
+        body.push_back(
+            makeNode(Node::Define, keep(name), defineValue(rest)));
+      } else if (cmd == "undef") {
+        body.push_back(makeNode(Node::Undef, keep(nextToken(rest))));
+      } else if (cmd == "ifdef" || cmd == "ifndef" || cmd == "if") {
+        Branch b;
+        if (cmd == "if") {
+          b.kind = Branch::If;
+          b.arg = std::string(trimView(rest));
+          b.expr = compileExpr(b.arg, exprs);
+        } else {
+          b.kind = cmd == "ifdef" ? Branch::Ifdef : Branch::Ifndef;
+          b.arg = std::string(nextToken(rest));
         }
-      } else {
-        if (mode == DirectiveMode::IncludesOnly) {
-          out << logical << "\n";
-        } else if (condActive(cond)) {
-          // Expand macros in the line before outputting
-          std::string expanded = expandMacrosRecursive(logical, macros);
-          out << expanded << "\n";
+        body.push_back(makeNode(Node::Cond));
+        Node &c = body.back();
+        c.branches.push_back(std::move(b));
+        open.push_back(&c);
+        scopes.push_back(&c.branches.back().body);
+      } else if (cmd == "elif" || cmd == "else") {
+        if (open.empty())
+          throw std::runtime_error("#" + std::string(cmd) + " without #if");
+        Branch b;
+        b.kind = cmd == "elif" ? Branch::If : Branch::Else;
+        if (cmd == "elif") {
+          b.arg = std::string(trimView(rest));
+          b.expr = compileExpr(b.arg, exprs);
         }
+        Node &c = *open.back();
+        c.branches.push_back(std::move(b));
+        scopes.back() = &c.branches.back().body;
+      } else if (cmd == "endif") {
+        if (open.empty())
+          throw std::runtime_error("#endif without #if");
+        open.pop_back();
+        scopes.pop_back();
+      } else {
+        throw std::runtime_error("Unknown directive: #" + std::string(cmd));
       }
     }
+    flushRun();
 
-    if (mode == DirectiveMode::All && !cond.empty())
+    if (!open.empty())
       throw std::runtime_error("Unclosed #if directive");
 
-    return out.str();
+    CommentScanner comments;
+    scanText(root, comments);
+    return root;
+  }
+
+  // Number of #include directives; valid after parse()
+  size_t includeCount() const { return includes; }
+
+  // The macro X of a file that is one `#ifndef X ... #endif` block
+  // (typically an include guard, opened with `#define X`) with only blank
+  // lines and comments around it, or "". While X is defined, such a file
+  // produces just the text around the block.
+  static std::string includeGuard(const std::vector<Node> &nodes) {
+    const Node *guarded = nullptr;
+    for (const Node &node : nodes) {
+      if (node.kind == Node::Once ||
+          (node.kind == Node::Text && isBlank(node.text)))
+        continue;
+      if (guarded || node.kind != Node::Cond || node.branches.size() != 1 ||
+          node.branches[0].kind != Branch::Ifndef)
+        return "";
+      guarded = &node;
+    }
+    return guarded ? guarded->branches[0].arg : "";
+  }
+
+private:
+  std::string_view src;
+  std::deque<std::string> &owned; // never moves its elements
+  DirectiveMode mode;
+  ExprCache *exprs; // may be null
+  Stats *stats;     // may be null
+  bool drop_comments;
+  size_t includes = 0;
+  size_t pos = 0;
+  std::vector<std::vector<Node> *> scopes;
+  // Conditionals open in the text kept by IncludesOnly
+  size_t text_conditionals = 0;
+  // Pending run of code lines, copied into a text node in one go
+  size_t run_start = 0;
+  size_t run_end = 0;
+
+  // The next line without its '\n'; `pos` moves past the newline
+  std::string_view nextLine() {
+    const char *begin = src.data() + pos;
+    const char *nl =
+        static_cast<const char *>(std::memchr(begin, '\n', src.size() - pos));
+    size_t len = nl ? static_cast<size_t>(nl - begin) : src.size() - pos;
+    pos += nl ? len + 1 : len;
+    return std::string_view(begin, len);
+  }
+
+  void flushRun() {
+    if (run_start == run_end)
+      return;
+    std::vector<Node> &body = *scopes.back();
+    if (body.empty() || body.back().kind != Node::Text)
+      body.push_back(makeNode(Node::Text));
+    append(body.back(), src.substr(run_start, run_end - run_start));
+    run_start = run_end = 0;
+  }
+
+  static Node makeNode(Node::Kind kind, std::string_view text = {},
+                       std::string value = "") {
+    Node node;
+    node.kind = kind;
+    node.text = text;
+    node.value = std::move(value);
+    return node;
+  }
+
+  bool inSource(std::string_view s) const {
+    std::less_equal<const char *> le;
+    return le(src.data(), s.data()) &&
+           le(s.data() + s.size(), src.data() + src.size());
+  }
+
+  // `s` if it is part of the source, else a copy in `owned`
+  std::string_view keep(std::string_view s) {
+    if (s.empty() || inSource(s))
+      return s;
+    return owned.emplace_back(s);
+  }
+
+  // Extend a text node. Source that follows on from it is taken in place;
+  // anything else makes the node own its text.
+  void append(Node &node, std::string_view piece) {
+    std::string_view &text = node.text;
+    if (text.empty()) {
+      text = keep(piece);
+    } else if (inSource(text) && inSource(piece) &&
+               text.data() + text.size() == piece.data()) {
+      text = std::string_view(text.data(), text.size() + piece.size());
+    } else if (!owned.empty() && text.data() == owned.back().data()) {
+      owned.back() += piece;
+      text = owned.back();
+    } else {
+      std::string joined(text);
+      joined += piece;
+      text = owned.emplace_back(std::move(joined));
+    }
+  }
+
+  // Consecutive code lines are merged into one text node; identifiers never
+  // span lines, so expanding the block is the same as expanding each line.
+  void appendText(std::string_view line) {
+    std::vector<Node> &body = *scopes.back();
+    if (body.empty() || body.back().kind != Node::Text)
+      body.push_back(makeNode(Node::Text));
+    // Take the line's newline from the source when it has one
+    if (inSource(line) && line.data() + line.size() < src.data() + src.size() &&
+        line.data()[line.size()] == '\n') {
+      append(body.back(), std::string_view(line.data(), line.size() + 1));
+    } else {
+      append(body.back(), line);
+      append(body.back(), "\n");
+    }
+  }
+  // Only whitespace and complete comments
+  static bool isBlank(std::string_view text) {
+    CommentScanner scanner;
+    bool blank = true;
+    scanner.scan(
+        text,
+        [&](size_t start, size_t len) {
+          blank = blank && trimView(text.substr(start, len)).empty();
+        },
+        [](size_t, size_t, bool) {});
+    return blank && !scanner.inComment();
+  }
+
+  // A #define value (or other directive argument) with its comments
+  // removed, as a C preprocessor would
+  static std::string defineValue(std::string_view rest) {
+    std::string_view value = trimView(rest);
+    if (value.find('/') == std::string_view::npos)
+      return std::string(value);
+    CommentScanner scanner;
+    return trim(stripComments(value, scanner));
+  }
+
+  // Drop comments if asked, then record where every identifier-like token
+  // outside comments sits, so instantiation only has to probe those spans
+  // and copies comments along with the code around them. Block comments are
+  // tracked across lines and nodes. Each branch of a conditional starts in
+  // the comment state before it; the code after it continues from the last
+  // branch, as branches that disagree are not supported.
+  void scanText(std::vector<Node> &nodes, CommentScanner &comments) {
+    for (Node &node : nodes) {
+      if (node.kind == Node::Cond) {
+        const CommentScanner before = comments;
+        for (Branch &b : node.branches) {
+          comments = before;
+          scanText(b.body, comments);
+        }
+        continue;
+      }
+      if (node.kind != Node::Text)
+        continue;
+      if (drop_comments)
+        node.text = owned.emplace_back(stripComments(node.text, comments));
+      if (mode != DirectiveMode::All)
+        continue;
+      auto index = [&](size_t offset, size_t len) {
+        std::string_view code(node.text.data() + offset, len);
+        forEachIdentifier(code, [&](size_t start, size_t n) {
+          node.idents.push_back({static_cast<uint32_t>(offset + start),
+                                 static_cast<uint32_t>(n)});
+        });
+      };
+      if (drop_comments)
+        index(0, node.text.size());
+      else
+        comments.scan(node.text, index, [](size_t, size_t, bool) {});
+    }
+  }
+};
+
+// A parsed file. Immutable once built, so templates (and preprocessors,
+// through an IncludeProvider) share it. Its text nodes point into the
+// source text rather than copying it; see SourceBuffer::parsed().
+struct ParsedSource {
+  std::vector<Node> nodes;
+  // Text that is not a slice of the source: continued directives, a last
+  // line without a newline, and text with its comments dropped
+  std::deque<std::string> owned;
+  size_t includes = 0;   // #include nodes, numbered by Node::include
+  size_t bytes = 0;      // size of the source text
+  size_t lines = 0;      // lines in the source text
+  size_t text_bytes = 0; // total size of the text nodes
+  std::string guard;     // see SourceParser::includeGuard()
+};
+
+static size_t textBytes(const std::vector<Node> &nodes) {
+  size_t n = 0;
+  for (const Node &node : nodes) {
+    if (node.kind == Node::Text)
+      n += node.text.size();
+    for (const Branch &b : node.branches)
+      n += textBytes(b.body);
+  }
+  return n;
+}
+
+// The result points into `contents`, which must outlive it
+static std::unique_ptr<const ParsedSource>
+parseSource(std::string_view contents, DirectiveMode mode, bool drop_comments,
+            ExprCache *exprs, Stats *stats) {
+  auto parsed = std::make_unique<ParsedSource>();
+  SourceParser parser(contents, parsed->owned, mode, exprs, stats,
+                      drop_comments);
+  parsed->nodes = parser.parse();
+  parsed->includes = parser.includeCount();
+  parsed->bytes = contents.size();
+  parsed->lines = std::count(contents.begin(), contents.end(), '\n');
+  if (!contents.empty() && contents.back() != '\n')
+    parsed->lines++;
+  parsed->text_bytes = textBytes(parsed->nodes);
+  parsed->guard = SourceParser::includeGuard(parsed->nodes);
+  return parsed;
+}
+
+//==============================================================
+// Macro definitions
+//==============================================================
+
+// Split a "NAME" or "NAME=VALUE" definition into its trimmed parts
+static std::pair<std::string, std::string>
+parseMacroDefinition(const std::string &def) {
+  size_t eq_pos = def.find('=');
+  if (eq_pos == std::string::npos)
+    return {trim(def), ""};
+  return {trim(def.substr(0, eq_pos)), trim(def.substr(eq_pos + 1))};
+}
+
+//==============================================================
+// Macro influence
+//
+// The macros one instantiation actually consulted (by expansion, defined(),
+// #ifdef/#ifndef or #if) in the state the caller supplied them. Output only
+// depends on those, so two macro sets with the same key() produce identical
+// output, and key_for() tells whether another variant is a duplicate without
+// preprocessing it. Macros the shader itself #defines or #undefs before
+// reading them are not inputs and are left out.
+//==============================================================
+class MacroInfluence {
+public:
+  // Consulted macros that were defined, sorted, one "NAME" or "NAME=VALUE"
+  // per line
+  const std::string &key() const { return key_; }
+
+  // The key that instantiating with `additional_macros` would produce
+  std::string key_for(const std::vector<std::string> &additional_macros) const {
+    std::unordered_map<std::string, std::string> per_call;
+    for (const auto &def : additional_macros) {
+      auto [name, value] = parseMacroDefinition(def);
+      per_call[std::move(name)] = std::move(value);
+    }
+
+    std::string key;
+    for (const Input &in : inputs) {
+      auto it = per_call.find(in.name);
+      if (it != per_call.end())
+        appendKey(key, in.name, it->second);
+      else if (in.global)
+        appendKey(key, in.name, in.global_value);
+    }
+    return key;
+  }
+
+  // Every consulted macro name, defined or not, sorted
+  std::vector<std::string> names() const {
+    std::vector<std::string> out;
+    for (const Input &in : inputs)
+      out.push_back(in.name);
+    return out;
+  }
+
+private:
+  friend class ShaderTemplate;
+
+  struct Input {
+    std::string name;
+    bool global = false; // defined through Options::macros
+    std::string global_value;
+  };
+
+  std::vector<Input> inputs; // sorted by name
+  std::string key_;
+
+  static void appendKey(std::string &key, const std::string &name,
+                        const std::string &value) {
+    key += name;
+    if (!value.empty())
+      key += "=" + value;
+    key += "\n";
+  }
+};
+
+//==============================================================
+// ShaderTemplate
+//
+// A compiled shader: the source (and every file it includes) parsed into a
+// tree of text segments, conditional branches with pre-lexed expressions and
+// #define/#undef events. Instantiating walks the tree against a macro set
+// without rescanning the source text. Templates are created through
+// Preprocessor::compile() / compile_file().
+//==============================================================
+class ShaderTemplate {
+public:
+  ShaderTemplate() = default;
+
+  std::string
+  instantiate(const std::vector<std::string> &additional_macros = {},
+              Stats *stats = nullptr) const {
+    std::string result;
+    StringSink sink(result);
+    instantiate(additional_macros, sink, stats);
+    return result;
+  }
+
+  // Stream the output into `sink` instead of building a string
+  void instantiate(const std::vector<std::string> &additional_macros,
+                   Sink &sink, Stats *stats = nullptr) const {
+    run(additional_macros, sink, stats, nullptr);
+  }
+
+  // Hash of the output, which is never materialized
+  uint64_t hash(const std::vector<std::string> &additional_macros = {},
+                uint64_t seed = 0) const {
+    HashSink sink(seed);
+    run(additional_macros, sink, nullptr, nullptr);
+    return sink.digest();
+  }
+
+  // Also record which macros the output depends on
+  std::string instantiate(const std::vector<std::string> &additional_macros,
+                          MacroInfluence &influence) const {
+    std::string result;
+    StringSink sink(result);
+    run(additional_macros, sink, nullptr, &influence);
+    return result;
+  }
+
+private:
+  friend class Preprocessor;
+
+  // One source file (or the root string) of the template. Includes that
+  // could not be loaded or parsed keep their error and only fail once an
+  // instantiation actually reaches them.
+  struct Unit {
+    std::string path;
+    std::shared_ptr<const ParsedSource> source; // null when `error` is set
+    std::vector<size_t> includes; // unit of each #include in `source`
+    // Per #include, the paths searched before the one it resolved to
+    std::vector<std::vector<std::string>> missing;
+    std::string error;
+  };
+
+  DirectiveMode mode = DirectiveMode::All;
+  std::vector<std::unique_ptr<Unit>> units; // units[0] is the root
+  // Total size of all text nodes; output is usually about this large
+  size_t text_bytes = 0;
+  std::shared_ptr<const MacroTable> global_macros; // all locked
+  // Compiled #if expressions and macro values, shared with the Preprocessor
+  std::shared_ptr<ExprCache> exprs;
+  std::shared_ptr<Tracer> tracer; // from Options, may be null
+  bool minify = false;            // from Options
+
+  // Collects the names of macros read in the state the caller supplied
+  class InfluenceRecorder final : public MacroObserver {
+  public:
+    void consulted(std::string_view name, const Macro *) override {
+      if (touched.count(name) || seen.count(name))
+        return;
+      names.emplace_back(name);
+      seen.insert(names.back());
+    }
+
+    // A #define or #undef reads whether the caller locked the macro, and
+    // from then on the shader owns it
+    void redefined(const Macro &m) {
+      consulted(m.name, m.defined ? &m : nullptr);
+      if (!m.locked)
+        touched.insert(m.name);
+    }
+
+    void finish(const std::vector<std::string> &additional_macros,
+                const MacroTable *globals, MacroInfluence &influence) const {
+      influence.inputs.clear();
+      for (const std::string &name : names) {
+        MacroInfluence::Input in;
+        in.name = name;
+        if (const Macro *g = globals ? globals->find(name) : nullptr) {
+          in.global = true;
+          in.global_value = g->value;
+        }
+        influence.inputs.push_back(std::move(in));
+      }
+      std::sort(influence.inputs.begin(), influence.inputs.end(),
+                [](const auto &a, const auto &b) { return a.name < b.name; });
+      influence.key_ = influence.key_for(additional_macros);
+    }
+
+  private:
+    std::deque<std::string> names; // owns the views in `seen`
+    std::unordered_set<std::string_view, NameHash> seen;
+    // Macros the shader took over; views into this run's macro table
+    std::unordered_set<std::string_view, NameHash> touched;
+  };
+
+  // State of one instantiation
+  struct Run {
+    Sink &out;
+    MacroTable macros;
+    std::vector<bool> include_stack; // indexed by unit
+    std::vector<bool> once;          // units that reached #pragma once
+    Stats *stats;                    // may be null
+    InfluenceRecorder *influence;    // may be null
+  };
+
+  void run(const std::vector<std::string> &additional_macros, Sink &sink,
+           Stats *stats, MacroInfluence *influence) const {
+    InfluenceRecorder recorder;
+    std::optional<MinifySink> minifier;
+    if (minify && mode == DirectiveMode::All)
+      minifier.emplace(sink);
+    Run run{minifier ? static_cast<Sink &>(*minifier) : sink,
+            {},
+            std::vector<bool>(units.size(), false),
+            std::vector<bool>(units.size(), false),
+            stats,
+            influence ? &recorder : nullptr};
+    if (mode == DirectiveMode::All)
+      buildMacros(additional_macros, run.macros);
+    if (influence)
+      run.macros.observer = &recorder;
+
+    sink.reserve(text_bytes);
+    if (!units.empty())
+      processUnit(0, run);
+    if (minifier)
+      minifier->finish();
+
+    if (influence)
+      recorder.finish(additional_macros, global_macros.get(), *influence);
+  }
+
+  static std::string_view displayName(const std::string &path) {
+    return path.empty() ? std::string_view("<source>") : path;
   }
 
   //----------------------------------------------------------
-  // Directive handler
+  // Build the combined macro table for one instantiation
   //----------------------------------------------------------
-  bool handleDirective(const std::string &t, std::stringstream &out,
-                       std::unordered_map<std::string, std::string> &macros,
-                       const std::unordered_set<std::string> &predefined_macros,
-                       std::vector<Cond> &cond,
-                       std::unordered_set<std::string> &include_stack,
-                       DirectiveMode mode) {
-    // split into tokens
-    std::string body = t.substr(1);
-    std::istringstream iss(body);
-    std::string cmd;
-    iss >> cmd;
-
-    if (cmd == "include") {
-      if (mode == DirectiveMode::All && !condActive(cond))
-        return true;
-      std::string file;
-      iss >> file;
-      if (file.size() >= 2 && file.front() == '"' && file.back() == '"')
-        file = file.substr(1, file.size() - 2);
-      out << processIncludeFile(file, macros, predefined_macros, include_stack,
-                                mode);
-      return true;
+  void buildMacros(const std::vector<std::string> &additional_macros,
+                   MacroTable &macros) const {
+    // Globals stay shared; only what this run defines or reads is copied
+    macros = MacroTable(global_macros);
+
+    for (const auto &def : additional_macros) {
+      auto [name, value] = parseMacroDefinition(def);
+      // Per-call macros override globals of the same name
+      macros.define(name, std::move(value)).locked = true;
     }
+  }
 
-    if (mode == DirectiveMode::IncludesOnly)
-      return false;
+  //----------------------------------------------------------
+  // Evaluate one compiled file
+  //----------------------------------------------------------
+  void processUnit(size_t index, Run &run) const {
+    const Unit &unit = *units[index];
+    if (!unit.error.empty())
+      throw std::runtime_error(unit.error);
+    if (run.include_stack[index])
+      throw std::runtime_error("Recursive include: " + unit.path);
+
+    Tracer::Span span(tracer.get(), "file", displayName(unit.path));
+    if (run.stats && index != 0)
+      recordPath(unit.path, run.stats->includes);
+    run.include_stack[index] = true;
+    processNodes(unit.source->nodes, index, run);
+    run.include_stack[index] = false;
+  }
 
-    if (cmd == "define") {
-      if (!condActive(cond))
-        return true;
-      std::string name;
-      iss >> name;
-      // Don't override predefined macros from options
-      if (predefined_macros.count(name))
-        return true;
-      std::string value = trim_value(iss);
-      macros[name] = value;
+  // A file is skipped without walking it when an earlier pass through it
+  // reached its `#pragma once`, or when its include guard is defined. In
+  // the latter case the caller still writes the text around the guard.
+  bool skipInclude(size_t index, Run &run) const {
+    const ParsedSource *source = units[index]->source.get();
+    if (!source)
+      return false;
+    if (run.once[index])
       return true;
+    return !source->guard.empty() && run.macros.contains(source->guard);
+  }
+
+  static void recordPath(const std::string &path,
+                         std::vector<std::string> &seen) {
+    namespace fs = std::filesystem;
+    std::string normal = fs::path(path).lexically_normal().string();
+    if (std::find(seen.begin(), seen.end(), normal) == seen.end())
+      seen.push_back(std::move(normal));
+  }
+
+  //----------------------------------------------------------
+  // Evaluate parsed nodes
+  //----------------------------------------------------------
+  void processNodes(const std::vector<Node> &nodes, size_t index,
+                    Run &run) const {
+    const Unit &unit = *units[index];
+    for (const Node &node : nodes) {
+      switch (node.kind) {
+      case Node::Text:
+        if (mode == DirectiveMode::IncludesOnly)
+          run.out.write(node.text);
+        else
+          expandText(node, run);
+        break;
+
+      case Node::Include: {
+        count(Directive::Include, run);
+        size_t target = unit.includes[node.include];
+        if (run.stats) {
+          for (const std::string &path : unit.missing[node.include])
+            recordPath(path, run.stats->missing_includes);
+        }
+        if (!skipInclude(target, run)) {
+          processUnit(target, run);
+          break;
+        }
+        if (run.stats)
+          // Still a dependency: an edit may remove the guard
+          recordPath(units[target]->path, run.stats->includes);
+        if (!run.once[target]) {
+          // Blank lines and comments outside the guard, as walking the
+          // file would have written them
+          for (const Node &outside : units[target]->source->nodes) {
+            if (outside.kind == Node::Text)
+              run.out.write(outside.text);
+          }
+        }
+        break;
+      }
+
+      case Node::Define: {
+        ScopedTimer timer(run.stats ? &run.stats->directive_time : nullptr);
+        count(Directive::Define, run);
+        // Don't override predefined macros from options
+        Macro &m = run.macros.intern(node.text);
+        if (run.influence)
+          run.influence->redefined(m);
+        if (!m.locked)
+          run.macros.define(m, node.value);
+        break;
+      }
+
+      case Node::Undef: {
+        ScopedTimer timer(run.stats ? &run.stats->directive_time : nullptr);
+        count(Directive::Undef, run);
+        // Don't undef predefined macros from options
+        Macro &m = run.macros.intern(node.text);
+        if (run.influence)
+          run.influence->redefined(m);
+        if (!m.locked)
+          run.macros.undef(node.text);
+        break;
+      }
+
+      case Node::Once:
+        run.once[index] = true;
+        break;
+
+      case Node::Cond:
+        if (run.stats)
+          countConditional(node, run);
+        for (const Branch &b : node.branches) {
+          if (branchTaken(b, run)) {
+            processNodes(b.body, index, run);
+            break;
+          }
+        }
+        break;
+      }
     }
+  }
 
-    if (cmd == "undef") {
-      if (!condActive(cond))
-        return true;
-      std::string name;
-      iss >> name;
-      // Don't undef predefined macros from options
-      if (predefined_macros.count(name))
-        return true;
-      macros.erase(name);
-      return true;
+  static void count(Directive d, Run &run) {
+    if (run.stats)
+      run.stats->directives[static_cast<size_t>(d)]++;
+  }
+
+  // A reached conditional: its opening directive, each #elif/#else and the
+  // #endif, whichever branch is taken
+  static void countConditional(const Node &node, Run &run) {
+    for (size_t i = 0; i < node.branches.size(); i++) {
+      Branch::Kind kind = node.branches[i].kind;
+      if (i > 0)
+        count(kind == Branch::Else ? Directive::Else : Directive::Elif, run);
+      else if (kind == Branch::If)
+        count(Directive::If, run);
+      else
+        count(kind == Branch::Ifdef ? Directive::Ifdef : Directive::Ifndef,
+              run);
     }
+    count(Directive::Endif, run);
+  }
 
-    if (cmd == "ifdef") {
-      std::string name;
-      iss >> name;
-      bool p = condActive(cond);
-      bool v = macros.count(name);
-      cond.push_back({p, p && v, p && v});
-      return true;
+  // Copy a text node, replacing the pre-indexed identifiers that are macros
+  static void expandText(const Node &node, Run &run) {
+    ScopedTimer timer(run.stats ? &run.stats->expansion_time : nullptr);
+    std::string_view text = node.text;
+    size_t copied = 0;
+    uint64_t expansions = 0;
+    for (const Span &id : node.idents) {
+      Macro *m = run.macros.find(text.substr(id.pos, id.len));
+      if (!m)
+        continue;
+      run.out.write(text.substr(copied, id.pos - copied));
+      run.out.write(expandMacroValue(*m, run.macros));
+      copied = id.pos + id.len;
+      expansions++;
     }
+    run.out.write(text.substr(copied));
+    if (run.stats)
+      run.stats->macro_expansions += expansions;
+  }
 
-    if (cmd == "ifndef") {
-      std::string name;
-      iss >> name;
-      bool p = condActive(cond);
-      bool v = !macros.count(name);
-      cond.push_back({p, p && v, p && v});
+  bool branchTaken(const Branch &b, Run &run) const {
+    switch (b.kind) {
+    case Branch::Ifdef:
+      return run.macros.contains(b.arg);
+    case Branch::Ifndef:
+      return !run.macros.contains(b.arg);
+    case Branch::If: {
+      ScopedTimer timer(run.stats ? &run.stats->expression_time : nullptr);
+      Tracer::Span span(tracer.get(), "expr", b.arg);
+      return b.expr->evaluate(run.macros, exprs.get()) != 0;
+    }
+    case Branch::Else:
       return true;
     }
+    return false;
+  }
+};
+
+//==============================================================
+// Source buffers
+//
+// The contents of a loaded file, seen by the parser as a string_view. Files
+// are read into a string of the right size in one go. On POSIX systems,
+// load() may instead memory-map files of at least map_threshold bytes
+// read-only (unless PRE_WGSL_NO_MMAP is defined). A mapping shows later
+// writes to the file and faults on access once the file shrinks, so it is
+// only for a caller that is done with the buffer before the file can
+// change: the include cache and templates keep what they load, and always
+// read.
+//==============================================================
+class SourceBuffer : public std::enable_shared_from_this<SourceBuffer> {
+public:
+  // Smaller files are cheaper to read than to map
+  static constexpr size_t map_threshold = 64 * 1024;
+
+  explicit SourceBuffer(std::string text)
+      : owned(std::move(text)), data_(owned) {}
+
+  SourceBuffer(const SourceBuffer &) = delete;
+  SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+  ~SourceBuffer() {
+#if PRE_WGSL_MMAP
+    if (map)
+      ::munmap(map, data_.size());
+#endif
+  }
 
-    if (cmd == "if") {
-      std::string expr = trim_value(iss);
-      bool p = condActive(cond);
-      bool v = false;
-      if (p) {
-        std::unordered_set<std::string> visiting;
-        ExprParser ep(expr, macros, visiting);
-        v = ep.parse() != 0;
+  // Throws std::runtime_error if the file cannot be read. With `allow_map`
+  // set, large files are mapped rather than read; see above.
+  static std::shared_ptr<const SourceBuffer> load(const std::string &path,
+                                                  bool allow_map = false) {
+#if PRE_WGSL_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("Could not open file: " + path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      ::close(fd);
+      throw std::runtime_error("Could not open file: " + path);
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+
+    if (allow_map && size >= map_threshold) {
+      void *p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        ::close(fd);
+        ::madvise(p, size, MADV_SEQUENTIAL);
+        auto buffer = std::make_shared<SourceBuffer>(std::string());
+        buffer->map = p;
+        buffer->data_ = std::string_view(static_cast<const char *>(p), size);
+        return buffer;
       }
-      cond.push_back({p, p && v, p && v});
-      return true;
     }
 
-    if (cmd == "elif") {
-      std::string expr = trim_value(iss);
+    // Read until EOF in case the file grew since fstat()
+    std::string text(size, '\0');
+    size_t n = 0;
+    for (;;) {
+      if (n == text.size())
+        text.resize(text.size() + 4096);
+      ssize_t got = ::read(fd, &text[n], text.size() - n);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0) {
+        ::close(fd);
+        if (got < 0)
+          throw std::runtime_error("Could not read file: " + path);
+        break;
+      }
+      n += static_cast<size_t>(got);
+    }
+    text.resize(n);
+    return std::make_shared<const SourceBuffer>(std::move(text));
+#else
+    (void)allow_map;
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f.is_open())
+      throw std::runtime_error("Could not open file: " + path);
+    std::string text(static_cast<size_t>(f.tellg()), '\0');
+    f.seekg(0);
+    f.read(&text[0], static_cast<std::streamsize>(text.size()));
+    text.resize(static_cast<size_t>(f.gcount()));
+    return std::make_shared<const SourceBuffer>(std::move(text));
+#endif
+  }
 
-      if (cond.empty())
-        throw std::runtime_error("#elif without #if");
+  std::string_view view() const { return data_; }
+  size_t size() const { return data_.size(); }
+  // Whether the contents are a memory mapping of the file
+  bool mapped() const { return map != nullptr; }
+
+  // The contents parsed, once per mode and drop_comments setting. The parse
+  // belongs to the buffer, and its text nodes point into the contents, so
+  // the pointer returned shares ownership of the buffer: the contents (and
+  // a mapping) stay around while any parse of them is in use.
+  std::shared_ptr<const ParsedSource> parsed(DirectiveMode mode,
+                                             bool drop_comments,
+                                             ExprCache *exprs,
+                                             Stats *stats) const {
+    size_t slot = static_cast<size_t>(mode) * 2 + (drop_comments ? 1 : 0);
+    {
+      std::lock_guard<std::mutex> lock(parses_mutex);
+      if (parses[slot])
+        return {shared_from_this(), parses[slot].get()};
+    }
 
-      Cond &c = cond.back();
-      if (!c.parent_active) {
-        c.active = false;
-        return true;
-      }
+    // Parse outside the lock. A racing thread's parse is equivalent, and
+    // whichever came first is kept, as it may already be in use.
+    auto result = parseSource(view(), mode, drop_comments, exprs, stats);
+    std::lock_guard<std::mutex> lock(parses_mutex);
+    if (!parses[slot])
+      parses[slot] = std::move(result);
+    return {shared_from_this(), parses[slot].get()};
+  }
 
-      if (c.taken) {
-        c.active = false;
-        return true;
+private:
+  std::string owned;
+  std::string_view data_;
+  void *map = nullptr;
+  mutable std::mutex parses_mutex;
+  mutable std::array<std::unique_ptr<const ParsedSource>, 4> parses;
+};
+
+//==============================================================
+// Include cache
+//
+// Keeps the contents of files read by a Preprocessor, keyed by their
+// (lexically normalized) path. Every lookup re-checks the file's size and
+// modification time, so edited files are picked up without an explicit
+// invalidate(). The least recently used entries are evicted once the total
+// size exceeds the configured cap. All methods are safe to call concurrently.
+//==============================================================
+class IncludeCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  explicit IncludeCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+  // `stats`, if given, receives the hit or miss as well
+  std::shared_ptr<const SourceBuffer> load(const std::string &fname,
+                                           pre_wgsl::Stats *stats = nullptr) {
+    namespace fs = std::filesystem;
+    std::string key = fs::path(fname).lexically_normal().string();
+
+    std::error_code ec;
+    fs::file_time_type mtime = fs::last_write_time(key, ec);
+    uintmax_t size = ec ? 0 : fs::file_size(key, ec);
+    if (ec) {
+      // Drop whatever we had; the file is gone or unreadable now
+      invalidate(key);
+      if (stats)
+        stats->include_cache_misses++;
+      return SourceBuffer::load(fname);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it != entries.end()) {
+        Entry &e = it->second;
+        if (e.mtime == mtime && e.size == size) {
+          stats_.hits++;
+          if (stats)
+            stats->include_cache_hits++;
+          lru.splice(lru.begin(), lru, e.lru);
+          return e.contents;
+        }
+        erase(it);
       }
+      stats_.misses++;
+    }
+    if (stats)
+      stats->include_cache_misses++;
+
+    // Read outside the lock so that threads loading different files do not
+    // serialize on I/O. Two threads missing on the same file both read it;
+    // the second insert simply replaces the first. Never mapped, as the
+    // contents outlive this call here and in templates parsed from them.
+    auto contents = SourceBuffer::load(fname);
+    if (contents->size() <= max_bytes) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it != entries.end())
+        erase(it);
+      lru.push_front(key);
+      entries[key] = {contents, mtime, size, lru.begin()};
+      stats_.bytes += contents->size();
+      evict();
+    }
+    return contents;
+  }
+
+  // Forget every cached file
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lru.clear();
+    stats_.bytes = 0;
+  }
+
+  // Forget one cached file
+  void invalidate(const std::string &fname) {
+    std::string key = std::filesystem::path(fname).lexically_normal().string();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end())
+      erase(it);
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats s = stats_;
+    s.entries = entries.size();
+    return s;
+  }
 
-      std::unordered_set<std::string> visiting;
-      ExprParser ep(expr, macros, visiting);
-      bool v = ep.parse() != 0;
-      c.active = v;
-      if (v)
-        c.taken = true;
+private:
+  struct Entry {
+    std::shared_ptr<const SourceBuffer> contents;
+    std::filesystem::file_time_type mtime;
+    uintmax_t size;
+    std::list<std::string>::iterator lru;
+  };
+
+  size_t max_bytes;
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+  std::list<std::string> lru; // most recently used first
+  Stats stats_;
+
+  void erase(std::unordered_map<std::string, Entry>::iterator it) {
+    stats_.bytes -= it->second.contents->size();
+    lru.erase(it->second.lru);
+    entries.erase(it);
+  }
+
+  void evict() {
+    while (stats_.bytes > max_bytes && !lru.empty()) {
+      erase(entries.find(lru.back()));
+      stats_.evictions++;
+    }
+  }
+};
+
+//==============================================================
+// Include providers
+//
+// An IncludeProvider supplies the files that #include and the *_file()
+// calls read, by normalized path. DiskIncludeProvider (the default) reads
+// them through an IncludeCache; MemoryIncludeProvider serves sources
+// registered up front, e.g. shaders embedded in the binary or a browser
+// build without a filesystem. Providers are thread-safe and may be shared
+// by several preprocessors through Options::include_provider.
+//
+// Every provider also caches the parsed form of what it served, attached to
+// the contents: it is reused for as long as load() keeps returning the same
+// contents, so a shared header is parsed once rather than once per template
+// (or per preprocessor), and released along with them. Nothing outlives
+// the provider's own cache, so a file it does not hold on to (e.g. one over
+// the include cache's size cap, or one removed from a
+// MemoryIncludeProvider) keeps no parse around either.
+//==============================================================
+class IncludeProvider {
+public:
+  virtual ~IncludeProvider() = default;
+
+  // Contents of the file at `path`; throws std::runtime_error if there is
+  // none. Returning the same pointer for unchanged contents lets parsed()
+  // reuse its work.
+  virtual std::shared_ptr<const SourceBuffer> load(const std::string &path,
+                                                   Stats *stats) = 0;
+
+  // Changes whenever exists() may have changed its answer for some path,
+  // which drops the include lookups cached by preprocessors. Providers that
+  // cannot tell, like the filesystem, keep returning 0, so their lookups
+  // (found or not) last for the preprocessor's lifetime.
+  virtual uint64_t generation() const { return 0; }
+
+  // Whether there is a file at `path`; used to search include paths
+  virtual bool exists(const std::string &path) {
+    try {
+      load(path, nullptr);
       return true;
+    } catch (const std::runtime_error &) {
+      return false;
     }
+  }
+
+  // The parsed form of the file at `path`
+  std::shared_ptr<const ParsedSource> parsed(const std::string &path,
+                                             DirectiveMode mode,
+                                             bool drop_comments,
+                                             ExprCache *exprs, Stats *stats) {
+    std::shared_ptr<const SourceBuffer> contents;
+    {
+      ScopedTimer timer(stats ? &stats->io_time : nullptr);
+      contents = load(path, stats);
+    }
+    return contents->parsed(mode, drop_comments, exprs, stats);
+  }
+};
+
+// Reads files from disk, through an IncludeCache
+class DiskIncludeProvider final : public IncludeProvider {
+public:
+  explicit DiskIncludeProvider(size_t cache_bytes = 64 * 1024 * 1024)
+      : cache_(cache_bytes) {}
+
+  std::shared_ptr<const SourceBuffer> load(const std::string &path,
+                                           Stats *stats) override {
+    return cache_.load(path, stats);
+  }
+
+  bool exists(const std::string &path) override {
+    std::error_code ec;
+    return std::filesystem::is_regular_file(path, ec);
+  }
+
+  IncludeCache &cache() { return cache_; }
+
+private:
+  IncludeCache cache_;
+};
+
+// Serves sources registered with add(); never touches the filesystem
+class MemoryIncludeProvider final : public IncludeProvider {
+public:
+  // Register `contents` under `path`, replacing any previous source. Paths
+  // are normalized, so "./a/../common.wgsl" names "common.wgsl".
+  void add(const std::string &path, std::string contents) {
+    auto source = std::make_shared<const SourceBuffer>(std::move(contents));
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (sources.insert_or_assign(key(path), std::move(source)).second)
+      generation_++;
+  }
+
+  // Returns whether `path` was registered
+  bool remove(const std::string &path) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (sources.erase(key(path)) == 0)
+      return false;
+    generation_++;
+    return true;
+  }
+
+  uint64_t generation() const override { return generation_; }
+
+  bool contains(const std::string &path) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return sources.count(key(path)) != 0;
+  }
+
+  bool exists(const std::string &path) override { return contains(path); }
+
+  std::shared_ptr<const SourceBuffer> load(const std::string &path,
+                                           Stats *stats) override {
+    std::shared_ptr<const SourceBuffer> source;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      auto it = sources.find(key(path));
+      if (it != sources.end())
+        source = it->second;
+    }
+    if (!source)
+      throw std::runtime_error("Could not open file: " + path);
+    if (stats)
+      stats->include_cache_hits++;
+    return source;
+  }
+
+private:
+  mutable std::shared_mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<const SourceBuffer>>
+      sources;
+  std::atomic<uint64_t> generation_{0}; // bumped when a path comes or goes
+
+  static std::string key(const std::string &path) {
+    return std::filesystem::path(path).lexically_normal().string();
+  }
+};
+
+//==============================================================
+// Work-stealing pool
+//
+// Runs task(i) for every i in [0, count) on up to `threads` threads. Tasks
+// are dealt out in contiguous chunks, one deque per worker; a worker pops
+// from the front of its own deque and, once that is empty, steals from the
+// back of the others. Exceptions must be handled inside `task`.
+//==============================================================
+template <typename Task>
+static void runWorkStealing(size_t count, size_t threads, const Task &task) {
+  if (threads == 0)
+    threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++)
+      task(i);
+    return;
+  }
 
-    if (cmd == "else") {
-      if (cond.empty())
-        throw std::runtime_error("#else without #if");
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> items;
+  };
+  std::vector<Queue> queues(threads);
+  for (size_t i = 0; i < count; i++)
+    queues[i * threads / count].items.push_back(i);
 
-      Cond &c = cond.back();
-      if (!c.parent_active) {
-        c.active = false;
+  auto popOwn = [&](size_t w, size_t &item) {
+    std::lock_guard<std::mutex> lock(queues[w].mutex);
+    if (queues[w].items.empty())
+      return false;
+    item = queues[w].items.front();
+    queues[w].items.pop_front();
+    return true;
+  };
+  auto steal = [&](size_t w, size_t &item) {
+    for (size_t k = 1; k < threads; k++) {
+      Queue &victim = queues[(w + k) % threads];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.items.empty()) {
+        item = victim.items.back();
+        victim.items.pop_back();
         return true;
       }
-      if (c.taken) {
-        c.active = false;
-      } else {
-        c.active = true;
-        c.taken = true;
+    }
+    return false;
+  };
+  // No task is ever pushed after startup, so a worker that finds every
+  // deque empty can stop.
+  auto worker = [&](size_t w) {
+    size_t item;
+    while (popOwn(w, item) || steal(w, item))
+      task(item);
+  };
+
+  std::vector<std::thread> pool;
+  pool.reserve(threads - 1);
+  for (size_t w = 1; w < threads; w++)
+    pool.emplace_back(worker, w);
+  worker(0);
+  for (auto &t : pool)
+    t.join();
+}
+
+//==============================================================
+// Preprocessor
+//
+// After construction a Preprocessor is immutable apart from its internally
+// synchronized include cache, so one instance can be shared by any number of
+// threads calling the const preprocessing methods concurrently.
+//==============================================================
+
+// Result of Preprocessor::preprocess_hashed()
+struct HashedText {
+  std::string text;
+  uint64_t hash = 0; // hash64(text, seed)
+};
+
+// One unit of work for Preprocessor::preprocess_parallel()
+struct VariantJob {
+  std::string source; // shader text; ignored when `file` is set
+  std::string file;   // preprocess this file instead of `source`
+  std::vector<std::string> macros;
+};
+
+class Preprocessor {
+public:
+  explicit Preprocessor(Options opts = {})
+      : opts_(std::move(opts)) {
+    if (!opts_.include_provider) {
+      disk_ = std::make_shared<DiskIncludeProvider>(opts_.include_cache_bytes);
+      opts_.include_provider = disk_;
+    } else {
+      disk_ = std::dynamic_pointer_cast<DiskIncludeProvider>(
+          opts_.include_provider);
+    }
+    // Treat empty include path as current directory
+    if (opts_.include_path.empty()) {
+      opts_.include_path = ".";
+    }
+    parseMacroDefinitions(opts_.macros);
+  }
+
+  // Every preprocessing call takes an optional `stats` to fill in
+  std::string
+  preprocess_file(const std::string &filename,
+                  const std::vector<std::string> &additional_macros = {},
+                  Stats *stats = nullptr) const {
+    return compile_file(filename, stats).instantiate(additional_macros, stats);
+  }
+
+  std::string
+  preprocess(const std::string &contents,
+             const std::vector<std::string> &additional_macros = {},
+             Stats *stats = nullptr) const {
+    return compile(contents, stats).instantiate(additional_macros, stats);
+  }
+
+  // Stream the output into `sink`, e.g. straight into a pipeline-creation
+  // buffer, without materializing an intermediate string
+  void preprocess(const std::string &contents,
+                  const std::vector<std::string> &additional_macros,
+                  Sink &sink, Stats *stats = nullptr) const {
+    compile(contents, stats).instantiate(additional_macros, sink, stats);
+  }
+
+  void preprocess_file(const std::string &filename,
+                       const std::vector<std::string> &additional_macros,
+                       Sink &sink, Stats *stats = nullptr) const {
+    compile_file(filename, stats).instantiate(additional_macros, sink, stats);
+  }
+
+  // Output together with its hash64(), computed while it is produced
+  HashedText
+  preprocess_hashed(const std::string &contents,
+                    const std::vector<std::string> &additional_macros = {},
+                    uint64_t seed = 0) const {
+    return hashed(compile(contents), additional_macros, seed);
+  }
+
+  HashedText
+  preprocess_file_hashed(const std::string &filename,
+                         const std::vector<std::string> &additional_macros = {},
+                         uint64_t seed = 0) const {
+    return hashed(compile_file(filename), additional_macros, seed);
+  }
+
+  // Only the hash, e.g. to probe a pipeline cache; the output is never
+  // materialized
+  uint64_t
+  preprocess_hash(const std::string &contents,
+                  const std::vector<std::string> &additional_macros = {},
+                  uint64_t seed = 0) const {
+    return compile(contents).hash(additional_macros, seed);
+  }
+
+  uint64_t
+  preprocess_file_hash(const std::string &filename,
+                       const std::vector<std::string> &additional_macros = {},
+                       uint64_t seed = 0) const {
+    return compile_file(filename).hash(additional_macros, seed);
+  }
+
+  // Also report which macros the output depended on; see MacroInfluence
+  std::string preprocess(const std::string &contents,
+                         const std::vector<std::string> &additional_macros,
+                         MacroInfluence &influence) const {
+    return compile(contents).instantiate(additional_macros, influence);
+  }
+
+  std::string preprocess_file(const std::string &filename,
+                              const std::vector<std::string> &additional_macros,
+                              MacroInfluence &influence) const {
+    return compile_file(filename).instantiate(additional_macros, influence);
+  }
+
+  // Preprocess one shader once per macro set. The source is parsed a single
+  // time and every macro set is evaluated against that shared parse, which is
+  // much cheaper than calling preprocess() in a loop for large variant sweeps.
+  std::vector<std::string>
+  preprocess_variants(const std::string &contents,
+                      const std::vector<std::vector<std::string>> &macro_sets)
+      const {
+    ShaderTemplate tpl = compile(contents);
+    std::vector<std::string> results;
+    results.reserve(macro_sets.size());
+    for (const auto &macro_set : macro_sets) {
+      std::string name = variantName(macro_set);
+      Tracer::Span span(opts_.tracer.get(), "variant", name);
+      results.push_back(tpl.instantiate(macro_set));
+    }
+    return results;
+  }
+
+  std::string preprocess_includes_file(const std::string &filename,
+                                       Stats *stats = nullptr) const {
+    return compileTemplate(filename, DirectiveMode::IncludesOnly, stats)
+        .instantiate({}, stats);
+  }
+
+  std::string preprocess_includes(const std::string &contents,
+                                  Stats *stats = nullptr) const {
+    return compileTemplate("", DirectiveMode::IncludesOnly, stats, &contents)
+        .instantiate({}, stats);
+  }
+
+  // Parse a shader and everything it includes into a reusable template.
+  // Global macros from Options are captured; per-variant macros are passed
+  // to ShaderTemplate::instantiate().
+  ShaderTemplate compile(const std::string &contents,
+                         Stats *stats = nullptr) const {
+    return compileTemplate("", DirectiveMode::All, stats, &contents);
+  }
+
+  ShaderTemplate compile_file(const std::string &filename,
+                              Stats *stats = nullptr) const {
+    return compileTemplate(filename, DirectiveMode::All, stats);
+  }
+
+  // Preprocess independent jobs on `thread_count` threads (0 picks the
+  // hardware concurrency). Jobs with the same source or file share one
+  // compiled template. Results are returned in job order; if any job fails,
+  // the exception of the first failing job is rethrown once all have run.
+  std::vector<std::string>
+  preprocess_parallel(const std::vector<VariantJob> &jobs,
+                      size_t thread_count = 0) const {
+    // Compile each distinct source once
+    std::unordered_map<std::string_view, size_t> by_source, by_file;
+    std::vector<size_t> job_template(jobs.size());
+    std::vector<const VariantJob *> firsts;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      const VariantJob &job = jobs[i];
+      auto &index = job.file.empty() ? by_source : by_file;
+      auto key = job.file.empty() ? std::string_view(job.source)
+                                  : std::string_view(job.file);
+      auto [it, inserted] = index.emplace(key, firsts.size());
+      if (inserted)
+        firsts.push_back(&job);
+      job_template[i] = it->second;
+    }
+
+    std::vector<ShaderTemplate> templates(firsts.size());
+    std::vector<std::exception_ptr> compile_errors(firsts.size());
+    runWorkStealing(firsts.size(), thread_count, [&](size_t t) {
+      try {
+        const VariantJob &job = *firsts[t];
+        templates[t] =
+            job.file.empty() ? compile(job.source) : compile_file(job.file);
+      } catch (...) {
+        compile_errors[t] = std::current_exception();
       }
-      return true;
+    });
+
+    std::vector<std::string> results(jobs.size());
+    std::vector<std::exception_ptr> errors(jobs.size());
+    runWorkStealing(jobs.size(), thread_count, [&](size_t i) {
+      size_t t = job_template[i];
+      try {
+        if (compile_errors[t])
+          std::rethrow_exception(compile_errors[t]);
+        std::string name = variantName(jobs[i].macros);
+        Tracer::Span span(opts_.tracer.get(), "variant", name);
+        results[i] = templates[t].instantiate(jobs[i].macros);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+
+    for (const auto &e : errors) {
+      if (e)
+        std::rethrow_exception(e);
     }
+    return results;
+  }
 
-    if (cmd == "endif") {
-      if (cond.empty())
-        throw std::runtime_error("#endif without #if");
-      cond.pop_back();
+  // Contents of files read by this preprocessor, reused across calls. Only
+  // exists when files come from a DiskIncludeProvider.
+  IncludeCache &include_cache() const {
+    if (!disk_)
+      throw std::runtime_error("Includes are not read from disk");
+    return disk_->cache();
+  }
+
+  IncludeProvider &include_provider() const {
+    return *opts_.include_provider;
+  }
+
+  // Compiled #if expressions, shared by every template compiled here
+  ExprCache &expr_cache() const { return *expr_cache_; }
+
+private:
+  Options opts_;
+  std::shared_ptr<DiskIncludeProvider> disk_; // opts_.include_provider, if so
+  std::shared_ptr<MacroTable> global_macros = std::make_shared<MacroTable>();
+  std::shared_ptr<ExprCache> expr_cache_ = std::make_shared<ExprCache>();
+  // Resolved #include names by (including directory, name), valid while
+  // the provider's generation() is unchanged. Names that were not found are
+  // remembered too, with an empty path. Held by pointer, like the caches
+  // above, so that a Preprocessor stays copyable and movable.
+  struct ResolvedIncludes {
+    struct Entry {
+      std::string path;
+      std::vector<std::string> missing; // searched first, not there
+      uint64_t generation;
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+  };
+  std::shared_ptr<ResolvedIncludes> resolved_ =
+      std::make_shared<ResolvedIncludes>();
+
+  //----------------------------------------------------------
+  // Parse macro definitions into global_macros
+  //----------------------------------------------------------
+  void parseMacroDefinitions(const std::vector<std::string> &macro_defs) {
+    for (const auto &def : macro_defs) {
+      auto [name, value] = parseMacroDefinition(def);
+      Macro &m = global_macros->define(name, std::move(value));
+      m.locked = true;
+      // Shared by every call that reads the macro in an #if
+      m.value_expr = compileExpr(m.value, expr_cache_.get());
+    }
+  }
+
+  //----------------------------------------------------------
+  // Helpers
+  //----------------------------------------------------------
+  static HashedText hashed(const ShaderTemplate &tpl,
+                           const std::vector<std::string> &additional_macros,
+                           uint64_t seed) {
+    HashedText result;
+    StringSink text(result.text);
+    HashSink sink(seed, &text);
+    tpl.instantiate(additional_macros, sink);
+    result.hash = sink.digest();
+    return result;
+  }
+
+  // Trace label for one variant; empty unless tracing
+  std::string variantName(const std::vector<std::string> &macros) const {
+    std::string name;
+    if (!opts_.tracer)
+      return name;
+    for (const auto &m : macros)
+      name += (name.empty() ? "" : " ") + m;
+    return name.empty() ? "<no macros>" : name;
+  }
+
+  std::shared_ptr<const ParsedSource> parseFile(const std::string &path,
+                                                DirectiveMode mode,
+                                                Stats *stats) const {
+    return opts_.include_provider->parsed(path, mode, opts_.drop_comments,
+                                          expr_cache_.get(), stats);
+  }
+
+  //----------------------------------------------------------
+  // Compile a template rooted at `contents`, or at the file `path` when
+  // `contents` is null
+  //----------------------------------------------------------
+  ShaderTemplate compileTemplate(const std::string &path, DirectiveMode mode,
+                                 Stats *stats = nullptr,
+                                 const std::string *contents = nullptr) const {
+    Tracer::Span span(opts_.tracer.get(), "compile",
+                      ShaderTemplate::displayName(path));
+    ShaderTemplate tpl;
+    tpl.mode = mode;
+    tpl.global_macros = global_macros;
+    tpl.exprs = expr_cache_;
+    tpl.tracer = opts_.tracer;
+    tpl.minify = opts_.minify;
+    tpl.units.push_back(std::make_unique<ShaderTemplate::Unit>());
+    tpl.units[0]->path = path;
+
+    std::unordered_map<std::string, size_t> by_path;
+    if (!path.empty())
+      by_path[normalPath(path)] = 0;
+
+    // A source string is copied once, as the template may outlive it
+    tpl.units[0]->source =
+        contents ? std::make_shared<const SourceBuffer>(*contents)->parsed(
+                       mode, opts_.drop_comments, expr_cache_.get(), stats)
+                 : parseFile(path, mode, stats);
+    resolveIncludes(tpl, 0, by_path, stats);
+    // Counted here rather than when parsing, as parses are shared
+    for (const auto &unit : tpl.units) {
+      if (!unit->source)
+        continue;
+      tpl.text_bytes += unit->source->text_bytes;
+      if (stats)
+        stats->lines += unit->source->lines;
+    }
+    return tpl;
+  }
+
+  // Includes reached through different relative paths share one unit
+  static std::string normalPath(const std::string &path) {
+    return std::filesystem::path(path).lexically_normal().string();
+  }
+
+  // The file that `#include "name"` in the file `from` (empty for a source
+  // string) refers to, or "" if there is none; see Options::include_path.
+  // The paths searched before it are added to `missing`.
+  std::string resolveInclude(const std::string &from, const std::string &name,
+                             std::vector<std::string> &missing) const {
+    namespace fs = std::filesystem;
+    std::string dir = fs::path(from).parent_path().string();
+    std::string key = from.empty() ? "\n" : dir;
+    key += '\0';
+    key += name;
+    uint64_t generation = opts_.include_provider->generation();
+    {
+      std::lock_guard<std::mutex> lock(resolved_->mutex);
+      auto it = resolved_->entries.find(key);
+      if (it != resolved_->entries.end() &&
+          it->second.generation == generation) {
+        missing = it->second.missing;
+        return it->second.path;
+      }
+    }
+
+    std::string found;
+    missing.clear();
+    auto search = [&](const std::string &d) {
+      std::string candidate = (fs::path(d) / name).lexically_normal().string();
+      if (!opts_.include_provider->exists(candidate)) {
+        missing.push_back(std::move(candidate));
+        return false;
+      }
+      found = std::move(candidate);
       return true;
+    };
+    [&] {
+      if ((!from.empty() && search(dir)) || search(opts_.include_path))
+        return;
+      for (const std::string &d : opts_.include_paths) {
+        if (search(d))
+          return;
+      }
+    }();
+
+    std::lock_guard<std::mutex> lock(resolved_->mutex);
+    resolved_->entries[std::move(key)] = {found, missing, generation};
+    return found;
+  }
+
+  template <typename F>
+  static void forEachInclude(const std::vector<Node> &nodes, F &&f) {
+    for (const Node &node : nodes) {
+      if (node.kind == Node::Include)
+        f(node);
+      for (const Branch &b : node.branches)
+        forEachInclude(b.body, f);
     }
+  }
 
-    // Unknown directive
-    throw std::runtime_error("Unknown directive: #" + cmd);
+  // Compile every file reachable through #include from units[index],
+  // including those in branches that may never be taken. Each file is
+  // compiled once per template.
+  void resolveIncludes(ShaderTemplate &tpl, size_t index,
+                       std::unordered_map<std::string, size_t> &by_path,
+                       Stats *stats) const {
+    ShaderTemplate::Unit &from = *tpl.units[index];
+    from.includes.resize(from.source->includes);
+    from.missing.resize(from.source->includes);
+    forEachInclude(from.source->nodes, [&](const Node &node) {
+      std::string name(node.text);
+      std::string full_path =
+          resolveInclude(from.path, name, from.missing[node.include]);
+      std::string key = full_path.empty() ? "\n" + name : full_path;
+      auto it = by_path.find(key);
+      if (it != by_path.end()) {
+        from.includes[node.include] = it->second;
+        return;
+      }
+
+      size_t target = tpl.units.size();
+      from.includes[node.include] = target;
+      by_path[key] = target;
+      tpl.units.push_back(std::make_unique<ShaderTemplate::Unit>());
+      ShaderTemplate::Unit &unit = *tpl.units.back();
+      unit.path = full_path.empty() ? name : full_path;
+      Tracer::Span span(opts_.tracer.get(), "parse", unit.path);
+      try {
+        if (full_path.empty())
+          throw std::runtime_error("Could not find include file: " + name);
+        unit.source = parseFile(full_path, tpl.mode, stats);
+      } catch (const std::runtime_error &e) {
+        unit.error = e.what();
+        return;
+      }
+      if (stats)
+        stats->include_bytes += unit.source->bytes;
+      resolveIncludes(tpl, target, by_path, stats);
+    });
   }
 };
 
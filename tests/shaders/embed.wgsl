@@ -0,0 +1,7 @@
+// embed.wgsl, © and other non-ASCII bytes are embedded as they are
+#include "include_a.wgsl"
+#if MODE == 1
+let mode : i32 = 1;
+#else
+let mode : i32 = 0;
+#endif
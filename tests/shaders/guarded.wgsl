@@ -0,0 +1,5 @@
+// Guarded header
+#ifndef GUARDED_WGSL
+#define GUARDED_WGSL
+const guarded : i32 = 1;
+#endif
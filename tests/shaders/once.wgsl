@@ -0,0 +1,2 @@
+#pragma once
+const once : i32 = 2;
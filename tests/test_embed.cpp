@@ -0,0 +1,36 @@
+#include <string>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "pre_wgsl.hpp"
+#include "pre_wgsl_tests_shaders.hpp"
+
+static const std::string test_shader_dir = TEST_SHADER_DIR;
+
+TEST_CASE("embedded_variants_match_preprocess_file") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+    std::string file = test_shader_dir + "embed.wgsl";
+
+    REQUIRE(pre_wgsl_tests_shaders::shader_embed_one ==
+            pp.preprocess_file(file, {"MODE=1"}));
+    REQUIRE(pre_wgsl_tests_shaders::shader_embed_zero ==
+            pp.preprocess_file(file, {"MODE=0"}));
+}
+
+TEST_CASE("embedded_non_ascii_bytes") {
+    // UTF-8 for the copyright sign in embed.wgsl's first line
+    REQUIRE(pre_wgsl_tests_shaders::shader_embed_one.find("\xc2\xa9") !=
+            std::string_view::npos);
+}
+
+TEST_CASE("embedded_variant_lookup") {
+    using namespace pre_wgsl_tests_shaders;
+
+    static_assert(variants.size() == 2);
+    static_assert(find_variant("embed/one") == shader_embed_one);
+    REQUIRE(find_variant("embed/zero") == shader_embed_zero);
+    REQUIRE(find_variant("embed/two").empty());
+    REQUIRE(find_variant("").empty());
+}
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <string>
 
 #include <catch2/catch_test_macros.hpp>
@@ -754,3 +757,997 @@ TEST_CASE("per_call_macros_persistent_across_calls") {
     INFO("Preprocessor output (third call):\n" + out3);
     REQUIRE(out3.find("var val : i32 = 42;") != std::string::npos);
 }
+
+TEST_CASE("preprocess_variants_matches_preprocess") {
+    pre_wgsl::Options opts;
+    opts.macros = {"WG_SIZE=64"};
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#ifdef USE_F16
+enable f16;
+#define FLOAT f16
+#else
+#define FLOAT f32
+#endif
+#if TILE == 4
+var<workgroup> tile : array<FLOAT, WG_SIZE * 4>;
+#elif TILE == 8
+var<workgroup> tile : array<FLOAT, WG_SIZE * 8>;
+#endif
+)";
+
+    const std::vector<std::vector<std::string>> macro_sets = {
+        {"TILE=4"},
+        {"TILE=8", "USE_F16"},
+        {},
+    };
+
+    std::vector<std::string> outs = pp.preprocess_variants(src, macro_sets);
+    REQUIRE(outs.size() == macro_sets.size());
+    for (size_t i = 0; i < macro_sets.size(); i++) {
+        REQUIRE(outs[i] == pp.preprocess(src, macro_sets[i]));
+    }
+
+    REQUIRE(outs[0].find("array<f32, 64 * 4>") != std::string::npos);
+    REQUIRE(outs[1].find("enable f16;") != std::string::npos);
+    REQUIRE(outs[1].find("array<f16, 64 * 8>") != std::string::npos);
+    REQUIRE(outs[2].find("tile") == std::string::npos);
+}
+
+TEST_CASE("shader_template_instantiate") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    opts.macros = {"SCALE=2"};
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#include "include_a.wgsl"
+#if MODE == 1
+let v : i32 = a_from_include * SCALE;
+#else
+let v : i32 = 0;
+#endif
+)";
+
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+
+    std::string out1 = normalize_newlines(tpl.instantiate({"MODE=1"}));
+    REQUIRE(out1.find("let a_from_include : i32 = 42;") != std::string::npos);
+    REQUIRE(out1.find("let v : i32 = a_from_include * 2;") != std::string::npos);
+
+    std::string out2 = normalize_newlines(tpl.instantiate());
+    REQUIRE(out2.find("let v : i32 = 0;") != std::string::npos);
+    REQUIRE(tpl.instantiate({"MODE=1"}) == pp.preprocess(src, {"MODE=1"}));
+}
+
+TEST_CASE("shader_template_from_file") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+
+    pre_wgsl::ShaderTemplate tpl = pp.compile_file(test_shader_dir + "main_include.wgsl");
+    REQUIRE(tpl.instantiate() == pp.preprocess_file(test_shader_dir + "main_include.wgsl"));
+}
+
+TEST_CASE("shader_template_missing_include_in_inactive_branch") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#ifdef USE_EXTRA
+#include "does_not_exist.wgsl"
+#endif
+fn main() {}
+)";
+
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+    REQUIRE(normalize_newlines(tpl.instantiate()) == "fn main() {}\n");
+    REQUIRE_THROWS_AS(tpl.instantiate({"USE_EXTRA"}), std::runtime_error);
+}
+
+TEST_CASE("include_cache_hits_and_misses") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#include "include_a.wgsl"
+)";
+
+    for (int i = 0; i < 3; i++)
+        pp.preprocess(src);
+
+    pre_wgsl::IncludeCache::Stats stats = pp.include_cache().stats();
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.hits == 2);
+    REQUIRE(stats.entries == 1);
+
+    pp.include_cache().invalidate();
+    pp.preprocess(src);
+    REQUIRE(pp.include_cache().stats().misses == 2);
+}
+
+TEST_CASE("include_cache_detects_changes") {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "pre_wgsl_cache_test";
+    fs::create_directories(dir);
+    fs::path file = dir / "common.wgsl";
+    std::ofstream(file) << "let v : i32 = 1;\n";
+
+    pre_wgsl::Options opts;
+    opts.include_path = dir.string();
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#include "common.wgsl"
+)";
+    REQUIRE(pp.preprocess(src) == "let v : i32 = 1;\n");
+
+    // Different size, so the entry is stale even if the mtime is unchanged
+    std::ofstream(file) << "let v : i32 = 100;\n";
+    REQUIRE(pp.preprocess(src) == "let v : i32 = 100;\n");
+    REQUIRE(pp.include_cache().stats().misses == 2);
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("include_cache_memory_cap") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    opts.include_cache_bytes = 0;
+    pre_wgsl::Preprocessor pp(opts);
+
+    pp.preprocess_file(test_shader_dir + "main_include.wgsl");
+    pp.preprocess_file(test_shader_dir + "main_include.wgsl");
+
+    pre_wgsl::IncludeCache::Stats stats = pp.include_cache().stats();
+    REQUIRE(stats.hits == 0);
+    REQUIRE(stats.entries == 0);
+    REQUIRE(stats.bytes == 0);
+}
+
+TEST_CASE("preprocess_parallel_matches_sequential") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    opts.macros = {"BASE=10"};
+    const pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#include "include_a.wgsl"
+#if N % 2 == 0
+let even : i32 = BASE + N;
+#else
+let odd : i32 = BASE + N;
+#endif
+)";
+
+    std::vector<pre_wgsl::VariantJob> jobs;
+    for (int i = 0; i < 64; i++) {
+        pre_wgsl::VariantJob job;
+        if (i % 8 == 0)
+            job.file = test_shader_dir + "main_include.wgsl";
+        else
+            job.source = src;
+        job.macros = {"N=" + std::to_string(i)};
+        jobs.push_back(job);
+    }
+
+    std::vector<std::string> outs = pp.preprocess_parallel(jobs, 4);
+    REQUIRE(outs.size() == jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        std::string expected = jobs[i].file.empty()
+            ? pp.preprocess(jobs[i].source, jobs[i].macros)
+            : pp.preprocess_file(jobs[i].file, jobs[i].macros);
+        REQUIRE(outs[i] == expected);
+    }
+}
+
+TEST_CASE("preprocess_parallel_rethrows_first_error") {
+    const pre_wgsl::Preprocessor pp;
+
+    std::vector<pre_wgsl::VariantJob> jobs(8);
+    for (auto &job : jobs)
+        job.source = "let x : i32 = 1;\n";
+    jobs[5].source = "#if 1\n";
+
+    REQUIRE_THROWS_WITH(pp.preprocess_parallel(jobs, 3), "Unclosed #if directive");
+}
+
+TEST_CASE("macro_recursion_detected") {
+    pre_wgsl::Preprocessor pp;
+
+    const std::string code_src = R"(#define A (B + 1)
+#define B (A + 1)
+var x : i32 = A;
+)";
+    REQUIRE_THROWS_WITH(pp.preprocess(code_src), "Recursive macro: A");
+
+    const std::string if_src = R"(#define A B
+#define B A
+#if A
+#endif
+)";
+    REQUIRE_THROWS_AS(pp.preprocess(if_src), std::runtime_error);
+}
+
+TEST_CASE("macro_redefine_after_undef") {
+    pre_wgsl::Preprocessor pp;
+
+    const std::string src = R"(#define V 1
+var a : i32 = V;
+#undef V
+var b : i32 = V;
+#define V 3
+var c : i32 = V;
+)";
+
+    std::string out = normalize_newlines(pp.preprocess(src));
+    REQUIRE(out == "var a : i32 = 1;\nvar b : i32 = V;\nvar c : i32 = 3;\n");
+}
+
+TEST_CASE("macro_expansion_memo_invalidation") {
+    pre_wgsl::Preprocessor pp;
+
+    const std::string src = R"(#define Z (X / Y)
+#define Y 8
+var a : i32 = Z;
+#define X 64
+var b : i32 = Z;
+#undef Y
+var c : i32 = Z + Z;
+#define OUTER INNER * 2
+#define INNER LEAF
+#define LEAF 1
+var d : i32 = OUTER;
+#undef LEAF
+#define LEAF 5
+var e : i32 = OUTER;
+)";
+
+    std::string out = normalize_newlines(pp.preprocess(src));
+    INFO("Preprocessor output:\n" + out);
+    REQUIRE(out.find("var a : i32 = (X / 8);") != std::string::npos);
+    REQUIRE(out.find("var b : i32 = (64 / 8);") != std::string::npos);
+    REQUIRE(out.find("var c : i32 = (64 / Y) + (64 / Y);") != std::string::npos);
+    REQUIRE(out.find("var d : i32 = 1 * 2;") != std::string::npos);
+    REQUIRE(out.find("var e : i32 = 5 * 2;") != std::string::npos);
+}
+
+TEST_CASE("line_scanner_edge_cases") {
+    pre_wgsl::Preprocessor pp;
+
+    // CRLF line endings are kept, the last line gains a newline
+    REQUIRE(pp.preprocess("#define A 1\r\nlet a = A;\r\nlet b = 2;") ==
+            "let a = 1;\r\nlet b = 2;\n");
+
+    // Directive continuation at the very end of the input
+    REQUIRE(pp.preprocess("#define B 2 \\\n") == "");
+
+    // Indented directives and empty lines between code runs
+    REQUIRE(pp.preprocess("\n  #define C 3\n\nlet c = C;\n\n") == "\n\nlet c = 3;\n\n");
+
+    // Unterminated last line right after a directive
+    REQUIRE(pp.preprocess("#define D 4\nlet d = D;") == "let d = 4;\n");
+
+    REQUIRE(pp.preprocess("") == "");
+}
+
+TEST_CASE("sink_streams_output") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = R"(#define N 3
+#include "include_a.wgsl"
+let n : i32 = N;
+)";
+
+    std::string streamed;
+    size_t chunks = 0;
+    pre_wgsl::CallbackSink sink([&](std::string_view data) {
+        streamed.append(data);
+        chunks++;
+    });
+    pp.preprocess(src, {}, sink);
+
+    REQUIRE(streamed == pp.preprocess(src));
+    REQUIRE(chunks > 1);
+
+    // StringSink appends to what is already there
+    std::string out = "// header\n";
+    pre_wgsl::StringSink string_sink(out);
+    pp.preprocess_file(test_shader_dir + "main_include.wgsl", {}, string_sink);
+    REQUIRE(out == "// header\n" + pp.preprocess_file(test_shader_dir + "main_include.wgsl"));
+}
+
+TEST_CASE("identifier_scan_block_boundaries") {
+    pre_wgsl::Preprocessor pp;
+
+    // Put macros (and near-misses) at every offset across several SIMD
+    // blocks, including tokens that straddle block boundaries.
+    std::string src = "#define MACRO_NAME_THAT_IS_LONG v\n#define M w\n";
+    std::string expected;
+    for (size_t pad = 0; pad < 70; pad++) {
+        std::string spaces(pad, ' ');
+        src += spaces + "MACRO_NAME_THAT_IS_LONG+M_ M MACRO_NAME_THAT_IS_LONGX M\n";
+        expected += spaces + "v+M_ w MACRO_NAME_THAT_IS_LONGX w\n";
+    }
+    // Identifier running to the very end of the input
+    src += std::string(40, 'a') + " M";
+    expected += std::string(40, 'a') + " w\n";
+
+    REQUIRE(pp.preprocess(src) == expected);
+}
+
+TEST_CASE("expression_cache_reuse") {
+    pre_wgsl::Preprocessor pp;
+    std::string src =
+        "#if MODE == 1\n"
+        "one\n"
+        "#elif MODE == 2 || defined(EXTRA)\n"
+        "two\n"
+        "#else\n"
+        "other\n"
+        "#endif\n"
+        "#if MODE == 1\n"
+        "again\n"
+        "#endif\n";
+
+    REQUIRE(pp.preprocess(src, {"MODE=1"}) == "one\nagain\n");
+    REQUIRE(pp.preprocess(src, {"MODE=2"}) == "two\n");
+    REQUIRE(pp.preprocess(src, {"EXTRA"}) == "two\n");
+    REQUIRE(pp.preprocess(src, {"MODE=3"}) == "other\n");
+    // Two distinct #if expressions, plus the macro value "1" ("2", "3")
+    REQUIRE(pp.expr_cache().size() == 5);
+}
+
+TEST_CASE("expression_deep_nesting_and_macro_values") {
+    pre_wgsl::Preprocessor pp;
+
+    // Deeper than the evaluator's inline stack
+    std::string expr = "1";
+    for (int i = 0; i < 40; i++)
+        expr = "(" + std::to_string(i) + " + " + expr + ")";
+    REQUIRE(pp.preprocess("#if " + expr + " == 781\nok\n#endif\n") == "ok\n");
+
+    // Macro values are re-evaluated after a redefinition
+    std::string src =
+        "#define A B * 2\n"
+        "#define B 3\n"
+        "#if A == 6\n"
+        "six\n"
+        "#endif\n"
+        "#define B 4\n"
+        "#if A == 8\n"
+        "eight\n"
+        "#endif\n";
+    REQUIRE(pp.preprocess(src) == "six\neight\n");
+
+    REQUIRE_THROWS_WITH(pp.preprocess("#define X Y\n#define Y X\n#if X\n#endif\n"),
+                        "Recursive macro: X");
+}
+
+TEST_CASE("expression_errors_deferred_to_evaluation") {
+    pre_wgsl::Preprocessor pp;
+
+    // A malformed expression in a branch that is never evaluated is fine
+    std::string src =
+        "#if 1\n"
+        "ok\n"
+        "#elif (1\n"
+        "bad\n"
+        "#endif\n";
+    REQUIRE(pp.preprocess(src) == "ok\n");
+
+    REQUIRE_THROWS_WITH(pp.preprocess("#if (1\n#endif\n"), "missing ')'");
+    REQUIRE_THROWS_WITH(pp.preprocess("#if defined(1)\n#endif\n"),
+                        "expected identifier in defined()");
+}
+
+TEST_CASE("stats_counts_work") {
+    using pre_wgsl::Directive;
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src =
+        "#include \"include_a.wgsl\"\n"
+        "#define N 4\n"
+        "#ifdef N\n"
+        "let n = N + N;\n"
+        "#elif X > 1\n"
+        "#else\n"
+        "#endif\n"
+        "#if N == 4\n"
+        "#undef N\n"
+        "#endif\n"
+        "let m = N;";
+
+    pre_wgsl::Stats stats;
+    std::string out = pp.preprocess(src, {}, &stats);
+    REQUIRE(out == pp.preprocess(src));
+
+    REQUIRE(stats.lines == 11 + 3); // include_a.wgsl has three lines
+    REQUIRE(stats.directive(Directive::Include) == 1);
+    REQUIRE(stats.directive(Directive::Define) == 1);
+    REQUIRE(stats.directive(Directive::Undef) == 1);
+    REQUIRE(stats.directive(Directive::If) == 1);
+    REQUIRE(stats.directive(Directive::Ifdef) == 1);
+    REQUIRE(stats.directive(Directive::Ifndef) == 0);
+    REQUIRE(stats.directive(Directive::Elif) == 1);
+    REQUIRE(stats.directive(Directive::Else) == 1);
+    REQUIRE(stats.directive(Directive::Endif) == 2);
+    REQUIRE(stats.macro_expansions == 2);
+    REQUIRE(stats.include_bytes ==
+            std::filesystem::file_size(test_shader_dir + "include_a.wgsl"));
+    REQUIRE(stats.include_cache_misses == 1);
+    REQUIRE(stats.include_cache_hits == 0);
+
+    // Counters accumulate across calls
+    pp.preprocess(src, {}, &stats);
+    REQUIRE(stats.include_cache_hits == 1);
+    REQUIRE(stats.macro_expansions == 4);
+    REQUIRE(stats.lines == 2 * (11 + 3));
+    REQUIRE(stats.directive(Directive::Define) == 2);
+    REQUIRE(stats.io_time.count() > 0);
+
+    // Directives in branches not taken are not counted
+    pre_wgsl::Stats skipped;
+    pp.preprocess("#ifdef NEVER\n"
+                  "#define A 1\n"
+                  "#define B 2\n"
+                  "#undef A\n"
+                  "#endif\n"
+                  "let x = 1;\n",
+                  {}, &skipped);
+    REQUIRE(skipped.lines == 6);
+    REQUIRE(skipped.directive(Directive::Ifdef) == 1);
+    REQUIRE(skipped.directive(Directive::Endif) == 1);
+    REQUIRE(skipped.directive(Directive::Define) == 0);
+    REQUIRE(skipped.directive(Directive::Undef) == 0);
+}
+
+TEST_CASE("tracer_records_nested_spans") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    opts.tracer = std::make_shared<pre_wgsl::Tracer>();
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src =
+        "#include \"include_a.wgsl\"\n"
+        "#if MODE == 1\n"
+        "one\n"
+        "#endif\n";
+    pp.preprocess_variants(src, {{"MODE=1"}, {"Q=\"a\""}});
+
+    // compile, parse of the include, then per variant: variant, two files
+    // and one expression
+    REQUIRE(opts.tracer->size() == 2 + 2 * 4);
+
+    std::ostringstream os;
+    opts.tracer->write(os);
+    std::string json = os.str();
+    REQUIRE(json.rfind("{\"traceEvents\":[", 0) == 0);
+    REQUIRE(json.find("\"name\":\"<source>\",\"cat\":\"compile\"") != std::string::npos);
+    REQUIRE(json.find("include_a.wgsl\",\"cat\":\"parse\"") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"MODE == 1\",\"cat\":\"expr\"") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"Q=\\\"a\\\"\",\"cat\":\"variant\"") != std::string::npos);
+    REQUIRE(json.find("\"ph\":\"X\"") != std::string::npos);
+
+    opts.tracer->clear();
+    REQUIRE(opts.tracer->size() == 0);
+}
+
+TEST_CASE("stats_record_active_includes") {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "pre_wgsl_deps_test";
+    fs::create_directories(dir);
+    std::ofstream(dir / "a.wgsl") << "#include \"nested.wgsl\"\n";
+    std::ofstream(dir / "nested.wgsl") << "let n = 1;\n";
+    std::ofstream(dir / "b.wgsl") << "let b = 2;\n";
+    std::ofstream(dir / "c.wgsl") << "let c = 3;\n";
+
+    pre_wgsl::Options opts;
+    opts.include_path = dir.string();
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src =
+        "#include \"a.wgsl\"\n"
+        "#ifdef USE_B\n"
+        "#include \"b.wgsl\"\n"
+        "#else\n"
+        "#include \"c.wgsl\"\n"
+        "#endif\n"
+        "#include \"a.wgsl\"\n";
+
+    auto path = [&](const char *name) {
+        return (dir / name).lexically_normal().string();
+    };
+
+    pre_wgsl::Stats stats;
+    pp.preprocess(src, {"USE_B"}, &stats);
+    REQUIRE(stats.includes ==
+            std::vector<std::string>{path("a.wgsl"), path("nested.wgsl"),
+                                     path("b.wgsl")});
+
+    pre_wgsl::Stats other;
+    pp.compile(src).instantiate({}, &other);
+    REQUIRE(other.includes ==
+            std::vector<std::string>{path("a.wgsl"), path("nested.wgsl"),
+                                     path("c.wgsl")});
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("macro_influence_keys") {
+    pre_wgsl::Options opts;
+    opts.macros = {"G=1"};
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src =
+        "#ifdef USE_B\n"
+        "let b = 1;\n"
+        "#endif\n"
+        "#if MODE == 1 && G\n"
+        "let m = SCALE;\n"
+        "#endif\n"
+        "#define LOCAL 2\n"
+        "#if LOCAL\n"
+        "let l = LOCAL + DEP;\n"
+        "#endif\n"
+        "#define DEP INNER\n";
+
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+    pre_wgsl::MacroInfluence influence;
+    std::string out = tpl.instantiate({"MODE=1", "UNUSED=3"}, influence);
+    REQUIRE(out == tpl.instantiate({"MODE=1", "UNUSED=3"}));
+
+    // Only consulted, caller-supplied macros make up the key
+    REQUIRE(influence.key() == "G=1\nMODE=1\n");
+    REQUIRE(influence.key_for({"MODE=1"}) == influence.key());
+    REQUIRE(influence.key_for({"MODE=1", "OTHER"}) == influence.key());
+    REQUIRE(influence.key_for({"MODE=2"}) != influence.key());
+    REQUIRE(influence.key_for({"MODE=1", "USE_B"}) != influence.key());
+    REQUIRE(influence.key_for({"MODE=1", "SCALE=4"}) != influence.key());
+    // A caller definition would override the shader's own #define
+    REQUIRE(influence.key_for({"MODE=1", "LOCAL=0"}) != influence.key());
+
+    std::vector<std::string> names = influence.names();
+    for (const char *name : {"USE_B", "MODE", "G", "SCALE", "LOCAL", "DEP"})
+        REQUIRE(std::find(names.begin(), names.end(), name) != names.end());
+    // Never read: DEP is defined only after its last use
+    REQUIRE(std::find(names.begin(), names.end(), "INNER") == names.end());
+    REQUIRE(std::find(names.begin(), names.end(), "UNUSED") == names.end());
+}
+
+TEST_CASE("macro_influence_dedupes_variants") {
+    pre_wgsl::Preprocessor pp;
+    const std::string src =
+        "#define SCALE (FACTOR * 2)\n"
+        "#ifdef VEC4\n"
+        "let v : vec4<f32> = vec4<f32>(SCALE);\n"
+        "#else\n"
+        "let v : f32 = SCALE;\n"
+        "#endif\n";
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+
+    std::vector<std::vector<std::string>> sets = {
+        {}, {"VEC4"}, {"FACTOR=3"}, {"VEC4", "WG=64"}, {"WG=128"},
+        {"FACTOR=3", "WG=64"}, {"VEC4", "FACTOR=3"}};
+
+    // Same key <=> same output, and skipping by key_for() agrees
+    std::vector<std::pair<std::string, std::string>> seen;
+    for (const auto &set : sets) {
+        pre_wgsl::MacroInfluence influence;
+        std::string out = tpl.instantiate(set, influence);
+        for (const auto &[key, prev] : seen) {
+            if (key == influence.key())
+                REQUIRE(prev == out);
+        }
+        seen.emplace_back(influence.key(), out);
+
+        pre_wgsl::MacroInfluence first;
+        tpl.instantiate(sets[0], first);
+        REQUIRE((first.key_for(set) == first.key()) ==
+                (out == tpl.instantiate(sets[0])));
+    }
+    REQUIRE(seen[0].first == seen[4].first);
+    REQUIRE(seen[1].first == seen[3].first);
+    REQUIRE(seen[2].first == seen[5].first);
+}
+
+TEST_CASE("output_hash") {
+    REQUIRE(pre_wgsl::hash64("") == 0xEF46DB3751D8E999ull);
+    REQUIRE(pre_wgsl::hash64("a") == 0xD24EC4F1A98C6E5Bull);
+    REQUIRE(pre_wgsl::hash64("abc") == 0x44BC2CF5AD770999ull);
+
+    std::string data;
+    for (int i = 0; i < 200; i++)
+        data += static_cast<char>('a' + i % 26);
+    for (size_t step : {1, 3, 7, 31, 32, 33, 100}) {
+        pre_wgsl::Hasher64 h(42);
+        for (size_t i = 0; i < data.size(); i += step)
+            h.update(std::string_view(data).substr(i, step));
+        REQUIRE(h.digest() == pre_wgsl::hash64(data, 42));
+    }
+
+    pre_wgsl::Preprocessor pp;
+    const std::string src = "#define N 4\n"
+                            "#ifdef A\nlet a = N;\n#else\nlet b = N;\n#endif\n";
+    pre_wgsl::HashedText out = pp.preprocess_hashed(src, {"A"}, 7);
+    REQUIRE(out.text == pp.preprocess(src, {"A"}));
+    REQUIRE(out.hash == pre_wgsl::hash64(out.text, 7));
+    REQUIRE(pp.preprocess_hash(src, {"A"}, 7) == out.hash);
+    REQUIRE(pp.preprocess_hash(src, {"A"}) != out.hash);
+    REQUIRE(pp.preprocess_hash(src) == pre_wgsl::hash64(pp.preprocess(src)));
+    REQUIRE(pp.preprocess_file_hash(test_shader_dir + "include_a.wgsl") ==
+            pre_wgsl::hash64(pp.preprocess_file(test_shader_dir + "include_a.wgsl")));
+}
+
+TEST_CASE("minify_output") {
+    pre_wgsl::Options opts;
+    opts.minify = true;
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = "// License header\n"
+                            "#define N 4\n"
+                            "\n"
+                            "/* doc /* nested */ still doc */\n"
+                            "fn  main ( )  ->  f32 {\n"
+                            "    let a = N - -1;   // comment\n"
+                            "    let b = a / *p;\n"
+                            "    let c = a/b;\n"
+                            "    let d = x/**/y;\n"
+                            "    var<private> e: array<vec4<f32>, 2>;\n"
+                            "    return a;\n"
+                            "}\n";
+    REQUIRE(pp.preprocess(src) ==
+            "fn main()->f32{let a=4- -1;let b=a/ *p;let c=a/b;let d=x y;"
+            "var<private>e:array<vec4<f32>,2>;return a;}\n");
+
+    // Comments split across writes, and a '/' ending the output
+    std::string out;
+    pre_wgsl::StringSink inner(out);
+    pre_wgsl::MinifySink sink(inner);
+    for (std::string_view chunk : {"a /", "* x *", "/ b /", "/ y\n", "c /"})
+        sink.write(chunk);
+    sink.finish();
+    REQUIRE(out == "a b c/\n");
+
+    // Unicode identifiers keep the space that separates them
+    REQUIRE(pp.preprocess("let \xc3\xa9t\xc3\xa9 = 1;\n") ==
+            "let \xc3\xa9t\xc3\xa9=1;\n");
+
+    // Directives survive in preprocess_includes()
+    REQUIRE(pp.preprocess_includes("#define A  1\n") == "#define A  1\n");
+}
+
+TEST_CASE("comments_not_expanded") {
+    pre_wgsl::Preprocessor pp;
+    const std::string src = "#define N 4 // count\n"
+                            "#define M /* two */ 2\n"
+                            "let a = N; // N stays\n"
+                            "/* N\n"
+                            "   /* nested N */ N\n"
+                            "*/ let b = M/N;\n"
+                            "#ifdef X\n"
+                            "/* N\n"
+                            "#else\n"
+                            "/* N\n"
+                            "#endif\n"
+                            "N */ N\n";
+    REQUIRE(pp.preprocess(src) == "let a = 4; // N stays\n"
+                                  "/* N\n"
+                                  "   /* nested N */ N\n"
+                                  "*/ let b = 2/4;\n"
+                                  "/* N\n"
+                                  "N */ 4\n");
+
+    pre_wgsl::Options opts;
+    opts.drop_comments = true;
+    pre_wgsl::Preprocessor dropping(opts);
+    REQUIRE(dropping.preprocess(src) == "let a = 4; \n"
+                                        "\n"
+                                        "\n"
+                                        " let b = 2/4;\n"
+                                        "\n"
+                                        "  4\n");
+    REQUIRE(dropping.preprocess("let x = a/**/b;\n") == "let x = a b;\n");
+}
+
+TEST_CASE("include_guards_and_pragma_once") {
+    pre_wgsl::Options opts;
+    opts.include_path = test_shader_dir;
+    opts.tracer = std::make_shared<pre_wgsl::Tracer>();
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = "#include \"guarded.wgsl\"\n"
+                            "#include \"./guarded.wgsl\"\n"
+                            "#include \"once.wgsl\"\n"
+                            "#include \"../shaders/once.wgsl\"\n"
+                            "#include \"once.wgsl\"\n";
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+    opts.tracer->clear();
+    // The comment outside the guard is written on every include
+    REQUIRE(normalize_newlines(tpl.instantiate()) ==
+            "// Guarded header\nconst guarded : i32 = 1;\n"
+            "// Guarded header\nconst once : i32 = 2;\n");
+    // The root and each header once; repeats are skipped unopened
+    REQUIRE(opts.tracer->size() == 3);
+
+    // A guard defined by the caller skips the header outright
+    opts.tracer->clear();
+    pre_wgsl::Stats stats;
+    REQUIRE(normalize_newlines(tpl.instantiate({"GUARDED_WGSL"}, &stats)) ==
+            "// Guarded header\n// Guarded header\nconst once : i32 = 2;\n");
+    REQUIRE(opts.tracer->size() == 2);
+
+    // Skipped headers are still dependencies
+    auto path = [](const char *name) {
+        return std::filesystem::path(test_shader_dir + name)
+            .lexically_normal()
+            .string();
+    };
+    REQUIRE(stats.includes == std::vector<std::string>{path("guarded.wgsl"),
+                                                       path("once.wgsl")});
+
+    // Code outside the #ifndef is not a guard, but still correct
+    std::string twice = pp.preprocess("#include \"include_a.wgsl\"\n"
+                                      "#include \"include_a.wgsl\"\n");
+    REQUIRE(twice.find("include_a") != twice.rfind("include_a"));
+
+    // Other pragmas are still unknown directives
+    REQUIRE_THROWS_AS(pp.preprocess("#pragma twice\n"), std::runtime_error);
+
+    // #pragma once only counts in a branch that is taken
+    auto files = std::make_shared<pre_wgsl::MemoryIncludeProvider>();
+    files->add("maybe.wgsl", "#ifdef NEVER\n#pragma once\n#endif\nmaybe\n");
+    files->add("sure.wgsl", "#ifndef NEVER\n#pragma once\n#endif\nsure\n");
+    pre_wgsl::Options mem;
+    mem.include_provider = files;
+    REQUIRE(pre_wgsl::Preprocessor(mem).preprocess(
+                "#include \"maybe.wgsl\"\n#include \"maybe.wgsl\"\n"
+                "#include \"sure.wgsl\"\n#include \"sure.wgsl\"\n") ==
+            "maybe\nmaybe\nsure\n");
+
+    // Skipping a guarded file writes the same text as walking it would
+    files->add("framed.wgsl", "// Copyright\n\n#ifndef FRAMED\n#define FRAMED\n"
+                              "framed\n#endif\n\n// trailer\n");
+    REQUIRE(pre_wgsl::Preprocessor(mem).preprocess(
+                "#include \"framed.wgsl\"\n#include \"framed.wgsl\"\n") ==
+            "// Copyright\n\nframed\n\n// trailer\n"
+            "// Copyright\n\n\n// trailer\n");
+
+    // Comments after the pragma are ignored
+    files->add("commented.wgsl", "#pragma once // guard\n"
+                                 "#pragma once /* twice */\ncommented\n");
+    REQUIRE(pre_wgsl::Preprocessor(mem).preprocess(
+                "#include \"commented.wgsl\"\n#include \"commented.wgsl\"\n") ==
+            "commented\n");
+
+    // Includes-only output keeps conditionals, and a pragma inside them
+    REQUIRE(pre_wgsl::Preprocessor(mem).preprocess_includes(
+                "#include \"maybe.wgsl\"\n#include \"maybe.wgsl\"\n") ==
+            "#ifdef NEVER\n#pragma once\n#endif\nmaybe\n"
+            "#ifdef NEVER\n#pragma once\n#endif\nmaybe\n");
+}
+
+TEST_CASE("memory_include_provider") {
+    auto files = std::make_shared<pre_wgsl::MemoryIncludeProvider>();
+    files->add("common.wgsl", "#define N 4\nconst n = N;\n");
+    files->add("lib/../main.wgsl", "#include \"common.wgsl\"\nlet x = N;\n");
+    REQUIRE(files->contains("./main.wgsl"));
+
+    pre_wgsl::Options opts;
+    opts.include_provider = files;
+    pre_wgsl::Preprocessor a(opts);
+    pre_wgsl::Preprocessor b(opts);
+
+    const std::string expected = "const n = 4;\nlet x = 4;\n";
+    pre_wgsl::Stats first;
+    REQUIRE(a.preprocess_file("main.wgsl", {}, &first) == expected);
+    REQUIRE(first.lines == 4);
+
+    // The second preprocessor reuses the parsed sources, and reports the
+    // same work
+    pre_wgsl::Stats second;
+    REQUIRE(b.preprocess_file("main.wgsl", {}, &second) == expected);
+    REQUIRE(second.lines == 4);
+    REQUIRE(second.directives == first.directives);
+    REQUIRE(second.directive(pre_wgsl::Directive::Define) == 1);
+    REQUIRE(b.preprocess("#include \"common.wgsl\"\n", {"N=2"}) ==
+            "const n = 2;\n");
+
+    // Replacing a source is picked up on the next compile
+    files->add("common.wgsl", "const n = 1;\n");
+    REQUIRE(a.preprocess_file("main.wgsl") == "const n = 1;\nlet x = N;\n");
+
+    // A parse lives as long as the contents: reused by every preprocessor
+    // while registered, not once replaced
+    files->add("cond.wgsl", "#if 1\nyes\n#endif\n");
+    pre_wgsl::Preprocessor c(opts);
+    pre_wgsl::Preprocessor d(opts);
+    REQUIRE(c.preprocess_file("cond.wgsl") == "yes\n");
+    REQUIRE(d.preprocess_file("cond.wgsl") == "yes\n");
+    REQUIRE(c.expr_cache().size() == 1);
+    REQUIRE(d.expr_cache().size() == 0);
+    files->add("cond.wgsl", "#if 1\nyes\n#endif\n");
+    REQUIRE(d.preprocess_file("cond.wgsl") == "yes\n");
+    REQUIRE(d.expr_cache().size() == 1);
+
+    REQUIRE(files->remove("common.wgsl"));
+    REQUIRE_FALSE(files->remove("common.wgsl"));
+    REQUIRE_THROWS_AS(a.preprocess_file("main.wgsl"), std::runtime_error);
+    REQUIRE_THROWS_AS(a.include_cache(), std::runtime_error);
+}
+
+TEST_CASE("include_search_paths") {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "pre_wgsl_search_test";
+    fs::remove_all(dir);
+    for (const char *sub : {"vendor", "common", "backend"})
+        fs::create_directories(dir / sub);
+    std::ofstream(dir / "vendor" / "v.wgsl") << "vendor\n";
+    std::ofstream(dir / "common" / "c.wgsl") << "#include \"v.wgsl\"\n"
+                                                "#include \"local.wgsl\"\n";
+    std::ofstream(dir / "common" / "local.wgsl") << "common local\n";
+    std::ofstream(dir / "backend" / "local.wgsl") << "backend local\n";
+    std::ofstream(dir / "backend" / "main.wgsl") << "#include \"local.wgsl\"\n"
+                                                    "#include \"c.wgsl\"\n";
+
+    pre_wgsl::Options opts;
+    opts.include_path = (dir / "common").string();
+    opts.include_paths = {(dir / "vendor").string()};
+    pre_wgsl::Preprocessor pp(opts);
+
+    // Next to the including file first, then the search paths in order
+    std::string main = (dir / "backend" / "main.wgsl").string();
+    pre_wgsl::Stats stats;
+    REQUIRE(pp.preprocess_file(main, {}, &stats) ==
+            "backend local\nvendor\ncommon local\n");
+    // Paths searched ahead of the files that were used
+    auto path = [&](const fs::path &p) { return p.lexically_normal().string(); };
+    REQUIRE(stats.missing_includes ==
+            std::vector<std::string>{path(dir / "backend" / "c.wgsl"),
+                                     path(dir / "common" / "v.wgsl")});
+
+    // Failed lookups on disk are remembered too; a new preprocessor looks
+    // again
+    REQUIRE_THROWS_AS(pp.preprocess("#include \"late.wgsl\"\n"),
+                      std::runtime_error);
+    std::ofstream(dir / "vendor" / "late.wgsl") << "late\n";
+    REQUIRE_THROWS_AS(pp.preprocess("#include \"late.wgsl\"\n"),
+                      std::runtime_error);
+    REQUIRE(pre_wgsl::Preprocessor(opts).preprocess(
+                "#include \"late.wgsl\"\n") == "late\n");
+
+    // In-memory sources added or removed later are seen by lookups
+    auto files = std::make_shared<pre_wgsl::MemoryIncludeProvider>();
+    pre_wgsl::Options mem;
+    mem.include_path = "lib";
+    mem.include_paths = {"vendor"};
+    mem.include_provider = files;
+    pre_wgsl::Preprocessor in_memory(mem);
+    const std::string src = "#include \"x.wgsl\"\n";
+    REQUIRE_THROWS_AS(in_memory.preprocess(src), std::runtime_error);
+    files->add("vendor/x.wgsl", "vendor x\n");
+    REQUIRE(in_memory.preprocess(src) == "vendor x\n");
+    files->add("lib/x.wgsl", "lib x\n");
+    REQUIRE(in_memory.preprocess(src) == "lib x\n");
+    files->remove("lib/x.wgsl");
+    REQUIRE(in_memory.preprocess(src) == "vendor x\n");
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("include_lookup_misses_cached") {
+    // Counts the stat calls made while searching include paths
+    struct CountingProvider : pre_wgsl::IncludeProvider {
+        pre_wgsl::MemoryIncludeProvider files;
+        size_t exists_calls = 0;
+        std::shared_ptr<const pre_wgsl::SourceBuffer>
+        load(const std::string& path, pre_wgsl::Stats* stats) override {
+            return files.load(path, stats);
+        }
+        bool exists(const std::string& path) override {
+            exists_calls++;
+            return files.exists(path);
+        }
+    };
+    auto provider = std::make_shared<CountingProvider>();
+    provider->files.add("main.wgsl", "#ifdef NEVER\n#include \"missing.wgsl\"\n"
+                                     "#endif\nmain\n");
+
+    pre_wgsl::Options opts;
+    opts.include_path = "lib";
+    opts.include_paths = {"vendor"};
+    opts.include_provider = provider;
+    pre_wgsl::Preprocessor pp(opts);
+
+    REQUIRE(pp.preprocess_file("main.wgsl") == "main\n");
+    // Next to main.wgsl, then lib, then vendor
+    REQUIRE(provider->exists_calls == 3);
+    REQUIRE(pp.preprocess_file("main.wgsl") == "main\n");
+    REQUIRE(provider->exists_calls == 3);
+
+    // Copies and moves share what was looked up
+    pre_wgsl::Preprocessor copy = pp;
+    std::vector<pre_wgsl::Preprocessor> all;
+    all.push_back(std::move(pp));
+    REQUIRE(copy.preprocess_file("main.wgsl") == "main\n");
+    REQUIRE(all[0].preprocess_file("main.wgsl") == "main\n");
+    REQUIRE(provider->exists_calls == 3);
+}
+
+TEST_CASE("source_buffer_loading") {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "pre_wgsl_buffer_test";
+    fs::create_directories(dir);
+
+    std::string small = "let a = 1;\n";
+    std::string large;
+    while (large.size() <= pre_wgsl::SourceBuffer::map_threshold)
+        large += "let b : i32 = VALUE;\n";
+    std::ofstream(dir / "small.wgsl", std::ios::binary) << small;
+    std::ofstream(dir / "large.wgsl", std::ios::binary) << large;
+
+    auto s = pre_wgsl::SourceBuffer::load((dir / "small.wgsl").string());
+    REQUIRE(s->view() == small);
+    REQUIRE_FALSE(s->mapped());
+    REQUIRE_FALSE(pre_wgsl::SourceBuffer::load((dir / "large.wgsl").string())
+                      ->mapped());
+    auto l = pre_wgsl::SourceBuffer::load((dir / "large.wgsl").string(), true);
+    REQUIRE(l->view() == large);
+#if PRE_WGSL_MMAP
+    REQUIRE(l->mapped());
+#endif
+    REQUIRE_THROWS_AS(pre_wgsl::SourceBuffer::load((dir / "none.wgsl").string()),
+                      std::runtime_error);
+
+    pre_wgsl::Preprocessor pp;
+    std::string out = pp.preprocess_file((dir / "large.wgsl").string(), {"VALUE=7"});
+    REQUIRE(out.size() == large.size() - large.size() / 21 * 4);
+    REQUIRE(out.rfind("let b : i32 = 7;\n", 0) == 0);
+
+    // A template keeps what it was compiled from, even if an included file
+    // is rewritten or truncated in place
+    std::ofstream(dir / "main.wgsl") << "#include \"large.wgsl\"\n";
+    pre_wgsl::ShaderTemplate tpl =
+        pp.compile_file((dir / "main.wgsl").string());
+    std::ofstream(dir / "large.wgsl", std::ios::binary)
+        << std::string(large.size(), ' ');
+    REQUIRE(tpl.instantiate({"VALUE=7"}) == out);
+    std::ofstream(dir / "large.wgsl", std::ios::binary) << small;
+    REQUIRE(tpl.instantiate({"VALUE=7"}) == out);
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("global_macros_layered_per_call") {
+    pre_wgsl::Options opts;
+    opts.macros = {"A=B", "G=1", "LIMIT=G + 1"};
+    pre_wgsl::Preprocessor pp(opts);
+
+    const std::string src = "#define B 2\n"
+                            "#define G 5\n"
+                            "#undef LIMIT\n"
+                            "#if LIMIT == 2\n"
+                            "a = A; g = G; x = X;\n"
+                            "#endif\n";
+    pre_wgsl::ShaderTemplate tpl = pp.compile(src);
+    // In-file defines see globals, but may not change them
+    REQUIRE(tpl.instantiate() == "a = 2; g = 1; x = X;\n");
+    REQUIRE(tpl.instantiate({"X=3", "G=7"}) == "");
+    REQUIRE(tpl.instantiate({"X=3", "B=4"}) == "a = 4; g = 1; x = 3;\n");
+    // Nothing leaks from one call into the next
+    REQUIRE(tpl.instantiate() == "a = 2; g = 1; x = X;\n");
+    REQUIRE(pp.preprocess("a = A; b = B;\n") == "a = B; b = B;\n");
+
+    pre_wgsl::MacroInfluence influence;
+    tpl.instantiate({"X=3"}, influence);
+    REQUIRE(influence.key() == "A=B\nG=1\nLIMIT=G + 1\nX=3\n");
+
+    // Const lookups read through to the base without copying into the layer
+    auto base = std::make_shared<pre_wgsl::MacroTable>();
+    base->define("A", "1");
+    const pre_wgsl::MacroTable layer(base);
+    REQUIRE(layer.find("A") == base->find("A"));
+    REQUIRE(layer.contains("A"));
+    REQUIRE_FALSE(layer.contains("B"));
+}
@@ -0,0 +1,239 @@
+// pre-wgsl-embed: preprocess shader variants at build time into a C++
+// header, one constexpr std::string_view per variant plus a lookup table.
+// Normally driven by the pre_wgsl_add_shaders() CMake function.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "pre_wgsl.hpp"
+
+namespace fs = std::filesystem;
+
+struct Variant {
+    std::string name;
+    std::vector<std::string> macros;
+};
+
+struct Entry {
+    std::string key;
+    std::string ident;
+    std::string source;
+};
+
+static void print_usage() {
+    std::cout << "Usage: pre-wgsl-embed -o header.hpp --shader file.wgsl... [options]\n";
+    std::cout << "Options:\n";
+    std::cout << "  -o <header>              Header to generate\n";
+    std::cout << "  --shader <file>          Shader to embed (repeatable)\n";
+    std::cout << "  --variant <name:M1,M2=V> Variant and its macros (repeatable)\n";
+    std::cout << "  --namespace <ns>         Namespace of the generated code\n";
+    std::cout << "  --depfile <file>         Write the files read as a depfile\n";
+    std::cout << "  -I <path>                Include search path (repeatable)\n";
+    std::cout << "  -D <macro>               Macro for every variant\n";
+}
+
+// "name:A,B=1" -> {"name", {"A", "B=1"}}
+static Variant parse_variant(const std::string& spec) {
+    Variant v;
+    size_t colon = spec.find(':');
+    v.name = spec.substr(0, colon);
+    if (colon == std::string::npos)
+        return v;
+    std::istringstream macros(spec.substr(colon + 1));
+    for (std::string m; std::getline(macros, m, ',');) {
+        if (!m.empty())
+            v.macros.push_back(m);
+    }
+    return v;
+}
+
+// Always prefixed, and never with two underscores in a row, so that no key
+// can produce a keyword or a name reserved to the implementation
+static std::string identifier(const std::string& key) {
+    std::string id = "shader_";
+    for (char c : key) {
+        if (!std::isalnum(static_cast<unsigned char>(c)))
+            c = '_';
+        if (c != '_' || id.back() != '_')
+            id += c;
+    }
+    return id;
+}
+
+static std::string quoted(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Same escaping as the CLI's depfiles
+static std::string escape_dep(const std::string& path) {
+    std::string out;
+    for (char c : path) {
+        if (c == ' ' || c == '#')
+            out += '\\';
+        else if (c == '$')
+            out += '$';
+        out += c;
+    }
+    return out;
+}
+
+static void write_header(std::ostream& os, const std::string& ns,
+                         const std::vector<Entry>& entries) {
+    os << "// Generated by pre-wgsl-embed. Do not edit.\n";
+    os << "#pragma once\n\n";
+    os << "#include <array>\n#include <cstddef>\n#include <string_view>\n#include <utility>\n\n";
+    os << "namespace " << ns << " {\n\n";
+
+    // Byte arrays rather than string literals: no compiler limits on literal
+    // length. Each byte is a '\xNN' literal, which is valid whether char is
+    // signed or not; a negative int would be narrowing where it is unsigned.
+    static const char hex[] = "0123456789abcdef";
+    os << "namespace detail {\n";
+    for (const Entry& e : entries) {
+        os << "inline constexpr char " << e.ident << "_data[] = {";
+        for (size_t i = 0; i < e.source.size(); i++) {
+            auto byte = static_cast<unsigned char>(e.source[i]);
+            os << (i % 16 ? "" : "\n   ") << " '\\x" << hex[byte >> 4]
+               << hex[byte & 0xf] << "',";
+        }
+        os << "\n    0};\n";
+    }
+    os << "} // namespace detail\n\n";
+
+    for (const Entry& e : entries) {
+        os << "// " << e.key << "\n";
+        os << "inline constexpr std::string_view " << e.ident << "{detail::"
+           << e.ident << "_data, " << e.source.size() << "};\n";
+    }
+
+    os << "\n// Every variant by key, sorted for lookup\n";
+    os << "inline constexpr std::array<std::pair<std::string_view, std::string_view>, "
+       << entries.size() << "> variants = {{\n";
+    for (const Entry& e : entries)
+        os << "    {" << quoted(e.key) << ", " << e.ident << "},\n";
+    os << "}};\n\n";
+
+    os << "// The variant stored under `key`, or an empty view\n";
+    os << "constexpr std::string_view find_variant(std::string_view key) {\n";
+    os << "    std::size_t lo = 0, hi = variants.size();\n";
+    os << "    while (lo < hi) {\n";
+    os << "        std::size_t mid = (lo + hi) / 2;\n";
+    os << "        if (variants[mid].first < key)\n";
+    os << "            lo = mid + 1;\n";
+    os << "        else\n";
+    os << "            hi = mid;\n";
+    os << "    }\n";
+    os << "    return lo < variants.size() && variants[lo].first == key\n";
+    os << "               ? variants[lo].second\n";
+    os << "               : std::string_view();\n";
+    os << "}\n\n";
+    os << "} // namespace " << ns << "\n";
+}
+
+int main(int argc, char** argv) {
+    std::string output;
+    std::string depfile;
+    std::string ns = "pre_wgsl_shaders";
+    std::vector<std::string> shaders;
+    std::vector<Variant> variants;
+    pre_wgsl::Options opts;
+    bool include_set = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--shader" && i + 1 < argc) {
+            shaders.push_back(argv[++i]);
+        } else if (arg == "--variant" && i + 1 < argc) {
+            variants.push_back(parse_variant(argv[++i]));
+        } else if (arg == "--namespace" && i + 1 < argc) {
+            ns = argv[++i];
+        } else if (arg == "--depfile" && i + 1 < argc) {
+            depfile = argv[++i];
+        } else if (arg == "-I" && i + 1 < argc) {
+            if (include_set)
+                opts.include_paths.push_back(argv[++i]);
+            else
+                opts.include_path = argv[++i];
+            include_set = true;
+        } else if (arg == "-D" && i + 1 < argc) {
+            opts.macros.push_back(argv[++i]);
+        } else {
+            print_usage();
+            return arg == "-h" ? 0 : 1;
+        }
+    }
+    if (output.empty() || shaders.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        pre_wgsl::Preprocessor pp(opts);
+        std::vector<Entry> entries;
+        std::set<std::string> deps(shaders.begin(), shaders.end());
+
+        for (const auto& shader : shaders) {
+            std::string stem = fs::path(shader).stem().string();
+            pre_wgsl::ShaderTemplate tpl = pp.compile_file(shader);
+            if (variants.empty()) {
+                pre_wgsl::Stats stats;
+                entries.push_back({stem, identifier(stem), tpl.instantiate({}, &stats)});
+                deps.insert(stats.includes.begin(), stats.includes.end());
+                continue;
+            }
+            for (const Variant& v : variants) {
+                pre_wgsl::Stats stats;
+                std::string key = stem + "/" + v.name;
+                entries.push_back({key, identifier(key), tpl.instantiate(v.macros, &stats)});
+                deps.insert(stats.includes.begin(), stats.includes.end());
+            }
+        }
+
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.key < b.key; });
+        for (size_t i = 1; i < entries.size(); i++) {
+            if (entries[i].key == entries[i - 1].key)
+                throw std::runtime_error("Duplicate variant: " + entries[i].key);
+        }
+        std::set<std::string> idents;
+        for (const Entry& e : entries) {
+            if (!idents.insert(e.ident).second)
+                throw std::runtime_error("Variant names collide as identifiers: " + e.ident);
+        }
+
+        std::ofstream f(output);
+        if (!f.is_open())
+            throw std::runtime_error("Could not open file: " + output);
+        write_header(f, ns, entries);
+
+        if (!depfile.empty()) {
+            std::ofstream d(depfile);
+            d << escape_dep(output) << ":";
+            for (const auto& dep : deps)
+                d << " \\\n  " << escape_dep(dep);
+            d << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "pre-wgsl-embed error: " << e.what() << "\n";
+        std::remove(output.c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -14,8 +14,25 @@ EMSCRIPTEN_BINDINGS(pre_wgsl_module) {
 
     register_vector<std::string>("VectorString");
 
+    // There is no filesystem in the browser; #include reads from here
+    class_<MemoryIncludeProvider>("IncludeFiles")
+        .smart_ptr_constructor("IncludeFiles",
+                               &std::make_shared<MemoryIncludeProvider>)
+        .function("add", &MemoryIncludeProvider::add)
+        .function("remove", &MemoryIncludeProvider::remove);
+
     class_<Preprocessor>("PreWGSL")
         .constructor<>()
         .constructor<Options>()
-        .function("preprocess", &Preprocessor::preprocess);
+        .constructor(optional_override(
+            [](Options opts, std::shared_ptr<MemoryIncludeProvider> files) {
+                opts.include_provider = std::move(files);
+                return new Preprocessor(std::move(opts));
+            }))
+        .function("preprocess",
+                  optional_override([](const Preprocessor& self,
+                                       const std::string& contents,
+                                       const std::vector<std::string>& macros) {
+                      return self.preprocess(contents, macros);
+                  }));
 }
@@ -2,6 +2,8 @@ import createPreWGSLModule from './pre-wgsl.mjs';
 
 export interface PreprocessorOptions {
   macros?: string[];
+  /** Files available to `#include`, by path */
+  includes?: Record<string, string>;
 }
 
 export interface PreprocessResult {
@@ -11,6 +13,7 @@ export interface PreprocessResult {
 class PreWGSLWrapper {
   private module: any;
   private preprocessor: any;
+  private includes: any = null;
 
   constructor(module: any, options: PreprocessorOptions = {}) {
     this.module = module;
@@ -24,12 +27,17 @@ class PreWGSLWrapper {
     }
 
     const cppOptions: any = {
-      // Note includePath is not currently supported in browser environment
       includePath: '.',
       macros: macrosVector
     };
 
-    this.preprocessor = new module.PreWGSL(cppOptions);
+    // There is no filesystem here, so includes are served from memory
+    this.includes = new module.IncludeFiles();
+    for (const [path, source] of Object.entries(options.includes ?? {})) {
+      this.includes.add(path, source);
+    }
+
+    this.preprocessor = new module.PreWGSL(cppOptions, this.includes);
   }
 
   /**
@@ -53,11 +61,24 @@ class PreWGSLWrapper {
     }
   }
 
+  /**
+   * Make a file available to `#include`, replacing any earlier version
+   * @param path Path as written in the `#include` directive
+   * @param source The file's WGSL source
+   */
+  addInclude(path: string, source: string): void {
+    this.includes.add(path, source);
+  }
+
   destroy(): void {
     if (this.preprocessor) {
       this.preprocessor.delete();
       this.preprocessor = null;
     }
+    if (this.includes) {
+      this.includes.delete();
+      this.includes = null;
+    }
   }
 }
 